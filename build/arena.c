@@ -0,0 +1,94 @@
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "util.h"
+
+struct ArenaBlock {
+	struct ArenaBlock *next;
+	alignas(max_align_t) char data[];
+};
+
+void
+arena_init(struct Arena *arena)
+{
+	arena->head = NULL;
+	arena->cur = NULL;
+	arena->left = 0;
+}
+
+static void *
+arena_bump(struct Arena *arena, size_t n, size_t align)
+{
+	struct ArenaBlock *block;
+	size_t pad;
+	void *p;
+
+	pad = (size_t)(-(uintptr_t)arena->cur & (align - 1));
+	if (n + pad > arena->left) {
+		/* Oversized requests get a block to themselves, so we don't throw
+		 * away what's left of the current one */
+		if (n > ARENA_BLOCK / 4) {
+			block = xmalloc(sizeof(*block) + n);
+			if (arena->head) {
+				block->next = arena->head->next;
+				arena->head->next = block;
+			} else {
+				block->next = NULL;
+				arena->head = block;
+			}
+			return block->data;
+		}
+		block = xmalloc(sizeof(*block) + ARENA_BLOCK);
+		block->next = arena->head;
+		arena->head = block;
+		arena->cur = block->data;
+		arena->left = ARENA_BLOCK;
+		pad = 0;
+	}
+
+	p = arena->cur + pad;
+	arena->cur += pad + n;
+	arena->left -= pad + n;
+	return p;
+}
+
+void *
+arena_alloc(struct Arena *arena, size_t n)
+{
+	return arena_bump(arena, n, alignof(max_align_t));
+}
+
+void *
+arena_calloc(struct Arena *arena, size_t n, size_t sz)
+{
+	void *p;
+	p = arena_alloc(arena, n * sz);
+	memset(p, 0, n * sz);
+	return p;
+}
+
+char *
+arena_strdup(struct Arena *arena, const char *s)
+{
+	size_t len;
+	char *ns;
+	len = strlen(s) + 1;
+	ns = arena_bump(arena, len, 1); /* no need to align chars */
+	memcpy(ns, s, len);
+	return ns;
+}
+
+void
+arena_destroy(struct Arena *arena)
+{
+	struct ArenaBlock *block, *next;
+
+	for (block = arena->head; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	arena_init(arena);
+}
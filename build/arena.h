@@ -0,0 +1,26 @@
+#ifndef INCLUDE_ARENA_H
+#define INCLUDE_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK 65536
+
+/* Bump allocator; everything in it is freed at once by arena_destroy */
+struct Arena {
+	struct ArenaBlock *head;
+	char *cur;
+	size_t left;
+};
+
+void
+arena_init(struct Arena *arena);
+void *
+arena_alloc(struct Arena *arena, size_t n);
+void *
+arena_calloc(struct Arena *arena, size_t n, size_t sz);
+char *
+arena_strdup(struct Arena *arena, const char *s);
+void
+arena_destroy(struct Arena *arena);
+
+#endif
@@ -0,0 +1,342 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "build.h"
+#include "builddb.h"
+#include "simpleds.h"
+#include "statcache.h"
+#include "table.h"
+#include "target.h"
+#include "threadpool.h"
+#include "util.h"
+
+/* Microbenchmarks for the hot data structures, and end-to-end timings over
+ * synthetic graphs whose commands are all empty, so that what's left is our
+ * own overhead. Run from a scratch directory, since it litters files. */
+
+#define BENCH_JOBS 8
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void
+report(const char *what, uint64_t ns, size_t n_ops)
+{
+	double ms, per_op;
+	ms = (double)ns / 1e6;
+	per_op = (double)ns / (double)(n_ops ? n_ops : 1);
+	printf("%-36s %10.2f ms %10.1f ns/op\n", what, ms, per_op);
+	fflush(stdout);
+}
+
+static char **
+make_keys(size_t n, const char *prefix, const char *suffix)
+{
+	char **keys;
+	char buf[64];
+
+	keys = xmalloc(n * sizeof(*keys));
+	for (size_t i = 0; i < n; i++) {
+		snprintf(buf, sizeof(buf), "%s%zu%s", prefix, i, suffix);
+		keys[i] = xmalloc(strlen(buf) + 1);
+		strcpy(keys[i], buf);
+	}
+	return keys;
+}
+
+static void
+free_keys(char **keys, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		free(keys[i]);
+	free(keys);
+}
+
+static void
+bench_table(size_t n)
+{
+	struct Table tbl;
+	char **keys, **missing;
+	uint64_t start;
+	size_t found;
+
+	keys = make_keys(n, "src/dir", "/file.c");
+	missing = make_keys(n, "obj/dir", "/file.o");
+
+	table_init(&tbl);
+	start = now_ns();
+	for (size_t i = 0; i < n; i++)
+		table_insert(&tbl, keys[i], keys[i]);
+	report("table_insert", now_ns() - start, n);
+
+	found = 0;
+	start = now_ns();
+	for (size_t i = 0; i < n; i++)
+		found += table_find(&tbl, keys[i]) != NULL;
+	report("table_find (hit)", now_ns() - start, n);
+
+	start = now_ns();
+	for (size_t i = 0; i < n; i++)
+		found += table_find(&tbl, missing[i]) != NULL;
+	report("table_find (miss)", now_ns() - start, n);
+	if (found != n)
+		die("table lost keys: found %zu of %zu", found, n);
+
+	table_destroy(&tbl);
+	free_keys(keys, n);
+	free_keys(missing, n);
+}
+
+static void
+bench_queue(size_t n)
+{
+	struct Queue q;
+	uint64_t start;
+	uintptr_t sum;
+	void *item;
+
+	queue_init(&q, n);
+	sum = 0;
+	start = now_ns();
+	for (size_t i = 0; i < n; i++)
+		queue_push(&q, (void *)(i + 1));
+	for (size_t i = 0; i < n; i++) {
+		item = queue_pop(&q);
+		sum += (uintptr_t)item;
+	}
+	report("queue_push + queue_pop", now_ns() - start, n);
+	if (sum != n * (n + 1) / 2)
+		die("queue lost items", 0);
+	queue_destroy(&q);
+}
+
+static void
+bench_job_nop(void *args)
+{
+	(void)args;
+}
+
+static void
+bench_threadpool(size_t n)
+{
+	struct ThreadPool pool;
+	uint64_t start;
+	size_t n_rt;
+
+	threadpool_init(&pool, BENCH_JOBS, 0);
+
+	start = now_ns();
+	for (size_t i = 0; i < n; i++)
+		threadpool_execute(&pool, &bench_job_nop, NULL);
+	threadpool_wait(&pool);
+	report("threadpool_execute (throughput)", now_ns() - start, n);
+
+	/* Round trips to an idle pool, i.e. how long a lone job waits */
+	n_rt = n / 10;
+	start = now_ns();
+	for (size_t i = 0; i < n_rt; i++) {
+		threadpool_execute(&pool, &bench_job_nop, NULL);
+		threadpool_wait(&pool);
+	}
+	report("threadpool_execute (latency)", now_ns() - start, n_rt);
+
+	threadpool_destroy(&pool);
+}
+
+/* A target whose command is empty, so nothing is ever spawned for it */
+static struct Target *
+add_target(
+	struct Depgraph *graph,
+	const char *name,
+	const char **deps,
+	size_t n_deps
+)
+{
+	struct Arena *arena = &graph->arena;
+	struct DepList *dl;
+
+	dl = arena_alloc(arena, sizeof(*dl) + n_deps * sizeof(*dl->data));
+	dl->len = n_deps;
+	for (size_t i = 0; i < n_deps; i++)
+		dl->data[i] = FRAG_CONSTRUCTOR(dep)(&graph->paths, deps[i]);
+	return graph_add_target(
+		graph,
+		target_from_rule(
+			arena,
+			make_rule(
+				arena,
+				FRAG_CONSTRUCTOR(target)(&graph->paths, name),
+				dl,
+				NULL,
+				0
+			),
+			&graph->dep_ids
+		)
+	);
+}
+
+#define BENCH_SRC "bench.src"
+
+/* n independent targets, all gathered up by the final one */
+static struct Target *
+shape_wide(struct Depgraph *graph, char **names, size_t n)
+{
+	const char *src = BENCH_SRC;
+	const char **deps;
+	struct Target *final;
+
+	deps = xmalloc(n * sizeof(*deps));
+	for (size_t i = 0; i < n; i++) {
+		add_target(graph, names[i], &src, 1);
+		deps[i] = names[i];
+	}
+	final = add_target(graph, "wide", deps, n);
+	free(deps);
+	return final;
+}
+
+/* One long chain */
+static struct Target *
+shape_deep(struct Depgraph *graph, char **names, size_t n)
+{
+	const char *dep = BENCH_SRC;
+	for (size_t i = 0; i < n; i++) {
+		add_target(graph, names[i], &dep, 1);
+		dep = names[i];
+	}
+	return add_target(graph, "deep", &dep, 1);
+}
+
+/* A chain of diamonds: every third target joins the two before it, which
+ * both depend on the join before that */
+static struct Target *
+shape_diamond(struct Depgraph *graph, char **names, size_t n)
+{
+	const char *join = BENCH_SRC;
+	const char *sides[2];
+	size_t i;
+
+	for (i = 0; i + 2 < n; i += 3) {
+		add_target(graph, names[i], &join, 1);
+		add_target(graph, names[i + 1], &join, 1);
+		sides[0] = names[i];
+		sides[1] = names[i + 1];
+		add_target(graph, names[i + 2], sides, 2);
+		join = names[i + 2];
+	}
+	return add_target(graph, "diamond", &join, 1);
+}
+
+static void
+touch(const char *path)
+{
+	int fd;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		die("couldn't create %s", path);
+	close(fd);
+}
+
+/* A null build stats every path in the pruned graph exactly once, as long
+ * as it really looked at all of it */
+static void
+check_visited(const char *what, size_t n_paths)
+{
+	size_t hits, misses;
+
+	statcache_counters(&hits, &misses);
+	if (misses != n_paths)
+		die("%s statted %zu paths, expected %zu", what, misses, n_paths);
+}
+
+static void
+bench_shape(
+	const char *shape,
+	struct Target *(*gen)(struct Depgraph *, char **, size_t),
+	size_t n
+)
+{
+	struct Depgraph graph;
+	struct Target *final;
+	struct Array leaves;
+	char **names;
+	char what[64];
+	uint64_t start;
+
+	names = make_keys(n, "t", ".out");
+	unlink(BUILDDB_PATH);
+
+	graph_init(&graph);
+	start = now_ns();
+	final = gen(&graph, names, n);
+	snprintf(what, sizeof(what), "%s: construct graph", shape);
+	report(what, now_ns() - start, n);
+
+	start = now_ns();
+	leaves = graph_prepare(&graph, final);
+	snprintf(what, sizeof(what), "%s: graph_prepare", shape);
+	report(what, now_ns() - start, n);
+	array_destroy(&leaves);
+
+	/* Nothing exists yet, so everything "runs" */
+	start = now_ns();
+	graph_build(&graph, final, BENCH_JOBS);
+	snprintf(what, sizeof(what), "%s: full build", shape);
+	report(what, now_ns() - start, n);
+
+	/* Once the outputs exist, one more build records their mtimes, and the
+	 * one after that has nothing left to do */
+	for (size_t i = 0; i < n; i++)
+		touch(names[i]);
+	touch(final->name);
+	graph_build(&graph, final, BENCH_JOBS);
+	start = now_ns();
+	graph_build(&graph, final, BENCH_JOBS);
+	snprintf(what, sizeof(what), "%s: null build", shape);
+	report(what, now_ns() - start, n);
+	check_visited(what, graph.reached.len);
+
+	for (size_t i = 0; i < n; i++)
+		unlink(names[i]);
+	unlink(final->name);
+	unlink(BUILDDB_PATH);
+	graph_destroy(&graph);
+	free_keys(names, n);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t n;
+	char dir[] = "/tmp/construct-bench.XXXXXX";
+
+	n = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+	if (!n)
+		die("usage: %s [n]", argv[0]);
+
+	bench_table(n * 10);
+	bench_queue(n * 10);
+	bench_threadpool(n * 10);
+
+	if (!mkdtemp(dir) || chdir(dir) == -1)
+		die("couldn't make a scratch directory", 0);
+	touch(BENCH_SRC);
+	bench_shape("wide", &shape_wide, n);
+	bench_shape("deep", &shape_deep, n);
+	bench_shape("diamond", &shape_diamond, n);
+	unlink(BENCH_SRC);
+	if (chdir("/") == -1 || rmdir(dir) == -1)
+		log(msgt_warn, "couldn't remove %s", dir);
+
+	return 0;
+}
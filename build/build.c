@@ -1,159 +1,596 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "build.h"
+#include "builddb.h"
+#include "cache.h"
 #include "simpleds.h"
-#include "table.h"
+#include "statcache.h"
+#include "intern.h"
+#include "jobserver.h"
 #include "target.h"
 #include "threadpool.h"
+#include "trace.h"
 #include "util.h"
+#include "watch.h"
 
+extern char **environ;
+
+/* Set to anything to have each build report how its caches did */
+#define STATS_ENV "CONSTRUCT_STATS"
+
+static inline struct Target *
+graph_dep(struct Depgraph *graph, struct Target *targ, size_t i)
+{
+	return graph->targets.data[graph->dep_ids.data[targ->deps.off + i]];
+}
+
+static inline struct Target *
+graph_codep(struct Depgraph *graph, struct Target *targ, size_t i)
+{
+	return graph->targets.data[graph->codep_ids.data[targ->codeps.off + i]];
+}
+
+/* Old-style check for targets the build db hasn't seen yet: rebuild if any
+ * dependency is younger than the target */
 static int
-target_check_ood(struct Target *targ)
+target_check_mtime(
+	struct Depgraph *graph,
+	struct Target *targ,
+	struct FileStat *targ_fs
+)
 {
 	int out_of_date;
-	struct stat sb;
-	struct timespec targ_mtim;
-
-	// Check if any dependencies are younger
-	if (stat(targ->name, &sb) == -1) { // doesn't exist
-		targ_mtim.tv_sec = 0;
-		targ_mtim.tv_nsec = 0;
-	} else {
-#ifdef __APPLE__ // piece of shit
-		targ_mtim = sb.st_mtimespec;
-#else
-		targ_mtim = sb.st_mtim;
-#endif
-	}
+	struct FileStat fs;
+	struct timespec targ_mtim, dep_mtim;
 
+	targ_mtim = targ_fs->mtim;
 	out_of_date = 0;
 	for (size_t i = 0; i < targ->deps.len; i++) {
-		out_of_date |= stat(targ->deps.data[i], &sb) == -1;
-		out_of_date |= targ_mtim.tv_sec < sb.st_mtim.tv_sec;
+		if (statcache_get(graph_dep(graph, targ, i)->name, &fs) == -1)
+			return 1;
+		dep_mtim = fs.mtim;
+		out_of_date |= targ_mtim.tv_sec < dep_mtim.tv_sec;
 		out_of_date |=
-			(targ_mtim.tv_sec == sb.st_mtim.tv_sec &&
-		     targ_mtim.tv_nsec < sb.st_mtim.tv_nsec);
+			(targ_mtim.tv_sec == dep_mtim.tv_sec &&
+		     targ_mtim.tv_nsec < dep_mtim.tv_nsec);
 	}
 
 	return out_of_date;
 }
 
+/* Fills in what the target would be built from now, and compares it against
+ * what it was last built from */
+static int
+target_check_ood(
+	struct Depgraph *graph,
+	struct Target *targ,
+	struct BuildDb *db,
+	struct BuildSig *sig
+)
+{
+	struct FileStat fs;
+	struct BuildSig old;
+	uint64_t h;
+	int missing;
+
+	sig->cmd_hash = hash64(targ->cmd, str_len(targ->cmd), 0);
+	sig->inputs_hash = 0;
+	missing = 0;
+	for (size_t i = 0; i < targ->deps.len; i++) {
+		const char *dep = graph_dep(graph, targ, i)->name;
+		sig->inputs_hash = hash64(dep, strlen(dep), sig->inputs_hash);
+		if (builddb_file_hash(db, dep, &h) == -1)
+			missing = 1;
+		else
+			sig->inputs_hash = hash64(&h, sizeof(h), sig->inputs_hash);
+	}
+
+	sig->complete = !missing;
+	if (missing || statcache_get(targ->name, &fs) == -1)
+		return 1;
+	if (builddb_get_sig(db, targ->name, &old) == -1)
+		return target_check_mtime(graph, targ, &fs);
+
+	return old.cmd_hash != sig->cmd_hash ||
+		old.inputs_hash != sig->inputs_hash ||
+		old.out_mtime_sec != (int64_t)fs.mtim.tv_sec ||
+		old.out_mtime_nsec != (int64_t)fs.mtim.tv_nsec;
+}
+
+/* Serialises pipe creation with spawning, so no other job's child can
+ * inherit our pipe before it is marked close-on-exec */
+static pthread_mutex_t spawn_mut = PTHREAD_MUTEX_INITIALIZER;
+
+/* Runs the job with stdout and stderr captured, and prints the command,
+ * everything it said and whether it failed in one go once it is done */
 int
 target_run(struct Target *targ)
 {
-	int status;
-	if (str_len(targ->cmd))
-		log(msgt_raw, "%s", targ->cmd);
-	status = system(targ->cmd);
-	return WEXITSTATUS(status);
+	posix_spawn_file_actions_t actions;
+	static char sh_path[] = "/bin/sh", sh_flag[] = "-c";
+	char *sh_argv[] = {sh_path, sh_flag, targ->cmd, NULL};
+	char **argv;
+	int pipefd[2], wstatus, status, err;
+	pid_t pid, waited;
+	Str out;
+	char buf[4096];
+	ssize_t n;
+
+	argv = targ->shell ? sh_argv : targ->argv;
+	if (!argv[0])
+		return 0; /* nothing to run */
+
+	pthread_mutex_lock(&spawn_mut);
+	if (pipe(pipefd) == -1)
+		die("failed to create pipe", 0);
+	fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDERR_FILENO);
+	err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(pipefd[1]);
+	pthread_mutex_unlock(&spawn_mut);
+
+	out = str_alloc();
+	if (!err)
+		while ((n = read(pipefd[0], buf, sizeof(buf))) != 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1)
+				break;
+			out = str_concatlen(out, buf, (size_t)n);
+		}
+	close(pipefd[0]);
+
+	status = 127;
+	if (!err) {
+		while ((waited = waitpid(pid, &wstatus, 0)) == -1 && errno == EINTR)
+			;
+		if (waited != -1)
+			status = WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) :
+				WEXITSTATUS(wstatus);
+	}
+
+	/* stdio locks are recursive, so log() can go in here too */
+	flockfile(stdout);
+	log(msgt_raw, "%s", targ->cmd);
+	if (err)
+		log(msgt_err, "failed to run %s: %s", argv[0], strerror(err));
+	fwrite(out, 1, str_len(out), stdout);
+	if (status)
+		log(msgt_err, "%s failed with exit status %d", targ->name, status);
+	fflush(stdout);
+	funlockfile(stdout);
+	str_free(out);
+	return status;
 }
 
 void
 graph_init(struct Depgraph *graph)
 {
 	graph->n_targets = 0;
-	table_init(&graph->targets);
+	arena_init(&graph->arena);
+	interner_init(&graph->paths, &graph->arena);
+	array_init(&graph->targets);
+	idarray_init(&graph->dep_ids);
+	idarray_init(&graph->codep_ids);
+	array_init(&graph->reached);
+}
+
+/* Make room for every id interned so far */
+static void
+graph_grow(struct Depgraph *graph)
+{
+	while (graph->targets.len < interner_len(&graph->paths))
+		array_push(&graph->targets, NULL);
 }
 
 struct Target *
 graph_add_target(struct Depgraph *graph, struct Target *target)
 {
-	struct Target *targ_loc;
-	targ_loc = table_insert(&graph->targets, target->name, target);
-	graph->n_targets++;
-	return targ_loc;
+	graph_grow(graph);
+	if (!graph->targets.data[target->id])
+		graph->n_targets++;
+	graph->targets.data[target->id] = target;
+	return target;
 }
 
 struct Target *
 graph_get_target(struct Depgraph *graph, const char *targ_name)
 {
-	struct Target **targ;
-	targ = (struct Target **)table_find(&graph->targets, targ_name);
-	return targ ? *targ : NULL;
+	uint32_t id;
+	if (intern_find(&graph->paths, targ_name, &id) == -1 ||
+	    id >= graph->targets.len)
+		return NULL;
+	return graph->targets.data[id];
 }
 
-/* BFS from the final target, prune, and find leaves */
-static inline struct Array
+/* BFS from the final target, prune, and find leaves. Also lays out the
+ * codependents of everything reachable as one CSR edge list, and renders
+ * the commands we might actually run. */
+struct Array
 graph_prepare(struct Depgraph *graph, struct Target *final_targ)
 {
 	struct Queue queue;
-	struct Array leaves;
-	struct stat sb;
+	struct Array leaves, *reached = &graph->reached;
+	struct IdArray *codep_ids = &graph->codep_ids;
+	uint32_t off;
 
-	queue_init(&queue, graph->n_targets);
+	queue_init(&queue, interner_len(&graph->paths));
 	array_init(&leaves);
+	reached->len = 0;
 
 	queue_push(&queue, final_targ);
 	final_targ->visited = 1;
 
 	while (queue_len(&queue)) {
-		struct Target *targ, *new;
+		struct Target *targ;
 
 		targ = queue_pop(&queue);
+		array_push(reached, targ);
+		target_render(targ, &graph->arena);
+		targ->codeps.len = 0;
+		atomic_store(&targ->n_sat_dep, 0); /* left at deps.len by a build */
+		targ->done = 0;
 		if (targ->deps.len == 0)
 			array_push(&leaves, targ);
 
 		for (size_t i = 0; i < targ->deps.len; i++) {
-			struct Target **c;
-			c = (struct Target **)
-				table_find(&graph->targets, targ->deps.data[i]);
+			struct Target *c;
+			uint32_t id;
+
+			id = graph->dep_ids.data[targ->deps.off + i];
+			c = graph->targets.data[id];
 			if (!c) {
-				/* If a dependency doesn't exist, it may be a source file */
-				if (stat(targ->deps.data[i], &sb) == -1)
-					die("bad target: %s", (Str)targ->deps.data[i]);
-				new = target_from_rule(make_rule(
-					FRAG_CONSTRUCTOR(target)(targ->deps.data[i]),
-					NULL,
-					NULL,
-					0
-				));
-				graph_add_target(graph, new);
-				c = &new;
+				/* If a dependency doesn't exist, it may be a source file;
+				 * whether it really exists is checked in one batch later */
+				c = target_from_rule(
+					&graph->arena,
+					make_rule(
+						&graph->arena,
+						FRAG_CONSTRUCTOR(target)(
+							&graph->paths,
+							interned(&graph->paths, id)
+						),
+						NULL,
+						NULL,
+						0
+					),
+					&graph->dep_ids
+				);
+				graph_add_target(graph, c);
 			}
 
-			array_push(&(*c)->codeps, targ); /* fill up codeps */
-			if (!(*c)->visited) {
-				queue_push(&queue, *c);
-				(*c)->visited = 1;
+			if (!c->visited) {
+				queue_push(&queue, c);
+				c->visited = 1;
 			}
 		}
 	}
 
+	/* Count everyone's codependents, hand out slices, then fill them */
+	for (size_t i = 0; i < reached->len; i++) {
+		struct Target *targ = reached->data[i];
+		for (size_t j = 0; j < targ->deps.len; j++)
+			graph_dep(graph, targ, j)->codeps.len++;
+	}
+	off = 0;
+	for (size_t i = 0; i < reached->len; i++) {
+		struct Target *targ = reached->data[i];
+		targ->codeps.off = off;
+		off += targ->codeps.len;
+		targ->codeps.len = 0;
+	}
+	idarray_resize(codep_ids, off);
+	for (size_t i = 0; i < reached->len; i++) {
+		struct Target *targ = reached->data[i];
+		for (size_t j = 0; j < targ->deps.len; j++) {
+			struct Target *c = graph_dep(graph, targ, j);
+			codep_ids->data[c->codeps.off + c->codeps.len++] = targ->id;
+		}
+	}
+
+	/* So that the graph can be prepared again */
+	for (size_t i = 0; i < reached->len; i++)
+		((struct Target *)reached->data[i])->visited = 0;
+
 	queue_destroy(&queue);
 	return leaves;
 }
 
+/* Orders the pruned graph topologically from the leaves up, then walks it
+ * backwards so that each target's priority is its own expected duration plus
+ * the longest chain of codependents waiting on it. */
+static void
+graph_prioritise(
+	struct Depgraph *graph,
+	struct Array *leaves,
+	struct BuildDb *db
+)
+{
+	struct Queue queue;
+	struct Array order;
+
+	queue_init(&queue, graph->n_targets);
+	array_init(&order);
+	for (size_t i = 0; i < leaves->len; i++)
+		queue_push(&queue, leaves->data[i]);
+
+	while (queue_len(&queue)) {
+		struct Target *targ;
+		targ = queue_pop(&queue);
+		array_push(&order, targ);
+		for (size_t i = 0; i < targ->codeps.len; i++) {
+			struct Target *c;
+			c = graph_codep(graph, targ, i);
+			if (++c->n_sat_dep == c->deps.len)
+				queue_push(&queue, c);
+		}
+	}
+
+	if (order.len != graph->reached.len)
+		die(
+			"dependency cycle: %zu targets can never become ready",
+			graph->reached.len - order.len
+		);
+
+	for (size_t i = order.len; i-- > 0;) {
+		struct Target *targ;
+		struct BuildDbRecord *rec;
+		uint64_t longest;
+
+		targ = order.data[i];
+		longest = 0;
+		for (size_t j = 0; j < targ->codeps.len; j++) {
+			struct Target *c;
+			c = graph_codep(graph, targ, j);
+			if (c->prio > longest)
+				longest = c->prio;
+		}
+
+		targ->prio = longest;
+		if (str_len(targ->cmd)) {
+			/* Restored from the cache, it may never have been timed here */
+			rec = builddb_get(db, targ->name);
+			targ->prio += rec && rec->duration_ns ? rec->duration_ns :
+				db->mean_ns;
+		}
+		targ->n_sat_dep = 0;
+	}
+
+	array_destroy(&order);
+	queue_destroy(&queue);
+}
+
 struct WorkerArg {
+	struct Depgraph *graph;
 	struct Target *targ;
+	struct ThreadPool *pool;
+	struct BuildDb *db;
+	struct Cache *cache;
+	struct Jobserver *js;
+	struct Trace *trace;
 	atomic_bool *error;
 };
 
+/* Brings an out-of-date target up to date, from the artifact cache if it
+ * has a copy, and returns the job's exit status. Only time spent actually
+ * running the job counts towards its duration, so a restore leaves it at 0
+ * and the build db keeps the real one. */
+static int
+target_make(struct WorkerArg *args, struct Target *targ, struct BuildSig *sig)
+{
+	struct CacheKey key;
+	struct timespec start, end;
+	int cacheable, token, status;
+
+	targ->duration_ns = 0;
+	if (!str_len(targ->cmd))
+		return target_run(targ); /* nothing to cache, or to take a slot for */
+
+	/* Phony targets have no sig, and so no key */
+	cacheable = args->cache->enabled && targ->deps.len && sig->complete;
+	if (cacheable) {
+		cache_key(&key, targ->name, sig);
+		if (cache_restore(args->cache, &key, targ->name) == 0) {
+			log(msgt_info, "restored %s from cache", targ->name);
+			return 0;
+		}
+	}
+
+	cache_detach(targ->name);
+	token = jobserver_acquire(args->js);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	status = target_run(targ);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	jobserver_release(args->js, token);
+	targ->duration_ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ull +
+		(uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+
+	if (!status && cacheable)
+		cache_store(args->cache, &key, targ->name);
+	return status;
+}
+
 static void
 graph_run_target(void *_args)
 {
 	struct WorkerArg args = *(struct WorkerArg *)_args;
 	struct Target *targ = args.targ;
-	int status;
+	struct BuildSig sig;
+	struct FileStat fs;
+	int status, out_of_date;
+	uint64_t trace_start;
+
+	if (*args.error)
+		return; /* don't start anything new, let the pool drain */
+	trace_start = trace_now(args.trace);
+
+	if (targ->deps.len == 0) /* phony if it has no deps */
+		out_of_date = str_len(targ->cmd) != 0;
+	else
+		out_of_date = target_check_ood(args.graph, targ, args.db, &sig);
 
-	if ((targ->deps.len == 0 || target_check_ood(targ)) &&
-	    targ->cmd) { /* phony if it has no deps */
-		status = target_run(targ);
+	if (out_of_date) {
+		status = target_make(&args, targ, &sig);
 		if (status) {
-			log(msgt_err, "job failed with exit status %d\n", status);
 			*args.error = true;
+			trace_job(args.trace, targ->name, trace_start, true);
+			return;
 		}
 	}
 
+	if (targ->deps.len) {
+		if (out_of_date)
+			statcache_invalidate(targ->name); /* we just wrote it */
+		statcache_get(targ->name, &fs);
+		sig.out_mtime_sec = (int64_t)fs.mtim.tv_sec;
+		sig.out_mtime_nsec = (int64_t)fs.mtim.tv_nsec;
+		builddb_record(args.db, targ->name, &sig, targ->duration_ns);
+	}
+	trace_job(args.trace, targ->name, trace_start, out_of_date);
+	targ->done = 1;
+
+	/* Whoever satisfies the last dependency gets to queue the codependent */
 	for (size_t i = 0; i < targ->codeps.len; i++) {
 		struct Target *c;
-		c = targ->codeps.data[i];
-		c->n_sat_dep++;
+		c = graph_codep(args.graph, targ, i);
+		if (atomic_fetch_add(&c->n_sat_dep, 1) + 1 == c->deps.len) {
+			args.targ = c;
+			threadpool_submit(args.pool, &graph_run_target, &args, c->prio);
+		}
+	}
+}
+
+/* Everything a build needs besides the graph itself. A one-off build sets it
+ * up, runs once and tears it down; a watch keeps it around between runs. */
+struct BuildCtx {
+	struct Depgraph *graph;
+	struct Array leaves;
+	struct BuildDb db;
+	struct Cache cache;
+	struct Jobserver js;
+	struct Trace trace;
+	struct ThreadPool pool;
+	atomic_bool error;
+};
+
+static void
+build_begin(
+	struct BuildCtx *ctx,
+	struct Depgraph *graph,
+	struct Target *final_targ,
+	unsigned max_jobs
+)
+{
+	const char **leaf_names;
+	struct FileStat fs;
+
+	ctx->graph = graph;
+	trace_init(&ctx->trace, getenv(TRACE_ENV));
+	statcache_clear();
+	ctx->leaves = graph_prepare(graph, final_targ);
+
+	/* Everything else is statted as a side effect of building it */
+	leaf_names = xmalloc(ctx->leaves.len * sizeof(*leaf_names));
+	for (size_t i = 0; i < ctx->leaves.len; i++)
+		leaf_names[i] = ((struct Target *)ctx->leaves.data[i])->name;
+	statcache_prefetch(leaf_names, ctx->leaves.len);
+	free(leaf_names);
+	for (size_t i = 0; i < ctx->leaves.len; i++) {
+		struct Target *leaf = ctx->leaves.data[i];
+		if (!str_len(leaf->cmd) && statcache_get(leaf->name, &fs) == -1)
+			die("bad target: %s", leaf->name);
 	}
+
+	builddb_load(&ctx->db, BUILDDB_PATH);
+	graph_prioritise(graph, &ctx->leaves, &ctx->db);
+
+	cache_init(&ctx->cache);
+	jobserver_init(&ctx->js, max_jobs);
+	threadpool_init(&ctx->pool, max_jobs, sizeof(struct WorkerArg));
+}
+
+/* Runs everything downstream of roots whose dependencies are all
+ * satisfied, i.e. have n_sat_dep == deps.len */
+static void
+build_run(struct BuildCtx *ctx, struct Array *roots)
+{
+	struct WorkerArg args;
+
+	atomic_store(&ctx->error, false);
+	args.graph = ctx->graph;
+	args.pool = &ctx->pool;
+	args.db = &ctx->db;
+	args.cache = &ctx->cache;
+	args.js = &ctx->js;
+	args.trace = &ctx->trace;
+	args.error = &ctx->error;
+	for (size_t i = 0; i < roots->len; i++) {
+		args.targ = roots->data[i];
+		threadpool_submit(
+			&ctx->pool,
+			&graph_run_target,
+			&args,
+			args.targ->prio
+		);
+	}
+	threadpool_wait(&ctx->pool);
+
+	if (builddb_save(&ctx->db, BUILDDB_PATH, &ctx->graph->paths) == -1)
+		log(msgt_warn, "failed to save build db %s", BUILDDB_PATH);
+}
+
+/* Puts what the runs so far left behind where other processes can see it:
+ * the cache back under its limit, if anything was added, and the trace */
+static void
+build_flush(struct BuildCtx *ctx)
+{
+	cache_trim(&ctx->cache);
+	if (trace_write(&ctx->trace) == -1)
+		log(msgt_warn, "failed to write trace %s", ctx->trace.path);
+}
+
+static void
+build_end(struct BuildCtx *ctx)
+{
+	size_t hits, misses;
+
+	threadpool_destroy(&ctx->pool);
+	jobserver_destroy(&ctx->js);
+	builddb_destroy(&ctx->db);
+
+	if (getenv(STATS_ENV)) {
+		statcache_counters(&hits, &misses);
+		log(msgt_info, "stat cache: %zu hits, %zu misses", hits, misses);
+		if (ctx->cache.enabled)
+			log(
+				msgt_info,
+				"artifact cache: %zu hits, %zu misses",
+				atomic_load(&ctx->cache.hits),
+				atomic_load(&ctx->cache.misses)
+			);
+	}
+	build_flush(ctx);
+	cache_destroy(&ctx->cache);
+	trace_destroy(&ctx->trace);
+
+	array_destroy(&ctx->leaves);
 }
 
 void
@@ -163,59 +600,172 @@ graph_build(
 	unsigned max_jobs
 )
 {
-	struct ThreadPool threadpool;
-	struct Array leaves;
-	struct Queue queue;
-	atomic_bool worker_error = false;
+	struct BuildCtx ctx;
 
-	leaves = graph_prepare(graph, final_targ);
-	threadpool_init(&threadpool, max_jobs, sizeof(struct WorkerArg));
+	build_begin(&ctx, graph, final_targ, max_jobs);
+	build_run(&ctx, &ctx.leaves);
+	build_end(&ctx);
+}
 
-	/* Multisource BFS from each leaf
-	 * NOTE: visited is flipped */
-	queue_init(&queue, graph->n_targets);
-	for (size_t i = 0; i < leaves.len; i++) {
-		queue_push(&queue, leaves.data[i]);
-		((struct Target *)(leaves.data[i]))->visited = 0;
+static void
+mark_dirty(struct Queue *queue, struct Target *targ)
+{
+	if (!targ->visited) {
+		targ->visited = 1;
+		queue_push(queue, targ);
 	}
+}
 
-	while (queue_len(&queue) && !worker_error) {
-		struct Target *targ;
-		struct WorkerArg args;
+/* Marks everything downstream of the changed sources dirty, along with
+ * whatever the last run didn't get done if it failed, and rewinds n_sat_dep
+ * so that only their dirty dependencies are left to wait on. Clean targets
+ * are left alone and never get scheduled; the dirty ones with nothing to
+ * wait on go in roots. */
+static size_t
+graph_mark_dirty(
+	struct Depgraph *graph,
+	struct Array *changed,
+	bool failed,
+	struct Array *roots
+)
+{
+	struct Queue queue;
+	struct Array dirty;
+	size_t n_dirty;
 
-		/* For every target depending on us we keep track of the
-		 * number of satisfied targets and only build it if all
-		 * its targets are satisfied */
+	queue_init(&queue, graph->n_targets);
+	array_init(&dirty);
+	for (size_t i = 0; i < changed->len; i++)
+		mark_dirty(&queue, changed->data[i]);
+	if (failed)
+		for (size_t i = 0; i < graph->reached.len; i++)
+			if (!((struct Target *)graph->reached.data[i])->done)
+				mark_dirty(&queue, graph->reached.data[i]);
+
+	while (queue_len(&queue)) {
+		struct Target *targ;
 		targ = queue_pop(&queue);
-		if (targ->n_sat_dep < targ->deps.len) {
-			queue_push(&queue, targ);
-			continue;
-		}
+		array_push(&dirty, targ);
+		for (size_t i = 0; i < targ->codeps.len; i++)
+			mark_dirty(&queue, graph_codep(graph, targ, i));
+	}
 
-		args.targ = targ;
-		args.error = &worker_error;
-		threadpool_execute(&threadpool, &graph_run_target, &args);
-		for (size_t i = 0; i < targ->codeps.len; i++) {
-			struct Target *c;
-			c = targ->codeps.data[i];
-			if (!c->visited)
-				continue;
-			c->visited = 0;
-			queue_push(&queue, c);
-		}
+	/* Everything that isn't dirty is done by now, failed run or not */
+	roots->len = 0;
+	for (size_t i = 0; i < dirty.len; i++) {
+		struct Target *targ = dirty.data[i];
+		size_t n_clean = 0;
+		for (size_t j = 0; j < targ->deps.len; j++)
+			n_clean += !graph_dep(graph, targ, j)->visited;
+		atomic_store(&targ->n_sat_dep, n_clean);
+		targ->done = 0;
+		if (n_clean == targ->deps.len)
+			array_push(roots, targ);
 	}
+	for (size_t i = 0; i < dirty.len; i++)
+		((struct Target *)dirty.data[i])->visited = 0;
 
-	threadpool_destroy(&threadpool);
+	n_dirty = dirty.len;
+	array_destroy(&dirty);
 	queue_destroy(&queue);
-	array_destroy(&leaves);
+	return n_dirty;
+}
+
+static volatile sig_atomic_t watch_stop;
+
+static void
+watch_on_signal(int sig)
+{
+	(void)sig;
+	watch_stop = 1;
 }
 
+/* Builds once, then stays resident and rebuilds just what's downstream of
+ * whichever sources change, until interrupted. The graph, db, stat cache
+ * and workers all carry over between rebuilds, so nothing is rescanned. */
 void
-graph_destroy(struct Depgraph *graph)
+graph_watch(
+	struct Depgraph *graph,
+	struct Target *final_targ,
+	unsigned max_jobs
+)
 {
-	TABLE_ITER(&graph->targets, it) {
-		TABLE_ITER_SKIP_INVALID(&graph->targets, it);
-		target_destroy(it->val);
+	struct BuildCtx ctx;
+	struct Watch watch;
+	struct Array sources, changed, roots;
+	struct sigaction sa, old_int, old_term;
+	struct timespec start, end;
+	size_t n_dirty;
+
+	build_begin(&ctx, graph, final_targ, max_jobs);
+	build_run(&ctx, &ctx.leaves);
+	build_flush(&ctx);
+
+	/* Targets without commands or dependencies are files someone edits */
+	array_init(&sources);
+	for (size_t i = 0; i < ctx.leaves.len; i++) {
+		struct Target *leaf = ctx.leaves.data[i];
+		if (!str_len(leaf->cmd))
+			array_push(&sources, leaf);
 	}
-	table_destroy(&graph->targets);
+	if (watch_init(&watch, &sources) == -1) {
+		log(msgt_warn, "watch mode isn't supported here, built once", 0);
+		array_destroy(&sources);
+		build_end(&ctx);
+		return;
+	}
+	array_destroy(&sources);
+
+	/* No SA_RESTART, so that a ^C gets us out of poll() */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = watch_on_signal;
+	sigemptyset(&sa.sa_mask);
+	watch_stop = 0;
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+
+	log(msgt_info, "watching for changes, ^C to stop", 0);
+	array_init(&changed);
+	array_init(&roots);
+	while (!watch_stop && watch_wait(&watch, &changed) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (size_t i = 0; i < changed.len; i++)
+			statcache_invalidate(((struct Target *)changed.data[i])->name);
+		n_dirty = graph_mark_dirty(
+			graph,
+			&changed,
+			atomic_load(&ctx.error),
+			&roots
+		);
+		build_run(&ctx, &roots);
+		build_flush(&ctx);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		log(
+			msgt_info,
+			"%zu changed, %zu dirty, rebuilt in %.1f ms",
+			changed.len,
+			n_dirty - changed.len,
+			(double)(end.tv_sec - start.tv_sec) * 1e3 +
+				(double)(end.tv_nsec - start.tv_nsec) / 1e6
+		);
+		changed.len = 0;
+	}
+	array_destroy(&changed);
+	array_destroy(&roots);
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	watch_destroy(&watch);
+	build_end(&ctx);
+}
+
+void
+graph_destroy(struct Depgraph *graph)
+{
+	array_destroy(&graph->targets);
+	idarray_destroy(&graph->dep_ids);
+	idarray_destroy(&graph->codep_ids);
+	array_destroy(&graph->reached);
+	interner_destroy(&graph->paths);
+	arena_destroy(&graph->arena);
 }
@@ -1,9 +1,9 @@
 #include <stdatomic.h>
 #include <unistd.h>
 
+#include "intern.h"
 #include "target.h"
 #include "simpleds.h"
-#include "table.h"
 
 #define DO_PRAGMA(x) _Pragma(#x)
 
@@ -21,7 +21,12 @@
 #ifndef INCLUDE_BUILD_H
 struct Depgraph {
 	size_t n_targets;
-	struct Table targets;
+	struct Arena arena;        /* rules, fragments, targets and paths */
+	struct Interner paths;     /* every path we've seen <-> dense id */
+	struct Array targets;      /* id -> struct Target *, NULL if none yet */
+	struct IdArray dep_ids;    /* CSR edges, sliced by Target.deps */
+	struct IdArray codep_ids;  /* CSR edges, sliced by Target.codeps */
+	struct Array reached;      /* what the last graph_prepare pruned down to */
 };
 #endif
 
@@ -47,12 +52,24 @@ DECLARE(
 	(struct Depgraph * graph, const char *targ_name)
 );
 
+DECLARE(
+	struct Array,
+	graph_prepare,
+	(struct Depgraph * graph, struct Target *final_targ)
+);
+
 DECLARE(
 	void,
 	graph_build,
 	(struct Depgraph * graph, struct Target *final_targ, unsigned max_jobs)
 );
 
+DECLARE(
+	void,
+	graph_watch,
+	(struct Depgraph * graph, struct Target *final_targ, unsigned max_jobs)
+);
+
 void
 graph_destroy(struct Depgraph *graph);
 
@@ -0,0 +1,401 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "builddb.h"
+#include "intern.h"
+#include "simpleds.h"
+#include "statcache.h"
+#include "table.h"
+#include "util.h"
+
+#define BUILDDB_HASH_CHUNK 65536
+
+/* A record created since loading, carrying its own key */
+struct BuildDbExtra {
+	struct BuildDbRecord rec;
+	char name[];
+};
+
+static void
+builddb_init(struct BuildDb *db)
+{
+	pthread_mutex_init(&db->mut, NULL);
+	table_init(&db->added);
+	array_init(&db->extra);
+	db->map = NULL;
+	db->map_len = 0;
+	db->recs = NULL;
+	db->n_recs = 0;
+	db->index = NULL;
+	db->n_slots = 0;
+	db->names = NULL;
+	db->names_len = 0;
+	db->touched = NULL;
+	db->mean_ns = BUILDDB_DEFAULT_NS;
+}
+
+/* A missing or unreadable db is not an error, we just start from scratch.
+ * Nothing is read until it's looked up. */
+void
+builddb_load(struct BuildDb *db, const char *path)
+{
+	int fd;
+	struct stat sb;
+	struct BuildDbHeader *hdr;
+	size_t space;
+
+	builddb_init(db);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(*hdr)) {
+		close(fd);
+		return;
+	}
+	db->map_len = (size_t)sb.st_size;
+	db->map = mmap(
+		NULL,
+		db->map_len,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE,
+		fd,
+		0
+	);
+	close(fd);
+	if (db->map == MAP_FAILED) {
+		db->map = NULL;
+		return;
+	}
+
+	hdr = db->map;
+	space = db->map_len - sizeof(*hdr);
+	if (memcmp(hdr->magic, BUILDDB_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != BUILDDB_VERSION) {
+		log(msgt_warn, "ignoring stale build db %s", path);
+		return;
+	}
+	if (hdr->n_records > space / sizeof(struct BuildDbRecord) ||
+	    hdr->n_slots & (hdr->n_slots - 1) ||
+	    (hdr->n_records && hdr->n_slots <= hdr->n_records) ||
+	    hdr->n_slots >
+	        (space - hdr->n_records * sizeof(struct BuildDbRecord)) /
+	            sizeof(uint32_t)) {
+		log(msgt_warn, "ignoring corrupt build db %s", path);
+		return;
+	}
+	db->recs = (struct BuildDbRecord *)(hdr + 1);
+	db->index = (uint32_t *)(db->recs + hdr->n_records);
+	db->names = (const char *)(db->index + hdr->n_slots);
+	db->names_len = db->map_len - (size_t)(db->names - (const char *)db->map);
+	if (db->names_len && db->names[db->names_len - 1] != '\0') {
+		log(msgt_warn, "ignoring corrupt build db %s", path);
+		db->recs = NULL;
+		db->index = NULL;
+		return;
+	}
+	db->n_recs = hdr->n_records;
+	db->n_slots = hdr->n_slots;
+	db->touched = xcalloc(db->n_recs ? db->n_recs : 1, sizeof(*db->touched));
+	if (hdr->mean_ns)
+		db->mean_ns = hdr->mean_ns;
+}
+
+/* Probes the mapping's index. Bad entries just don't match, and the probe
+ * gives up after a lap so a corrupt index can't loop forever. */
+static struct BuildDbRecord *
+builddb_find_mapped(struct BuildDb *db, const char *name, uint64_t hash)
+{
+	struct BuildDbRecord *rec;
+	uint64_t mask, i;
+	uint32_t slot;
+
+	if (!db->n_slots)
+		return NULL;
+	mask = db->n_slots - 1;
+	i = hash & mask;
+	for (uint64_t n = 0; n < db->n_slots; n++, i = (i + 1) & mask) {
+		slot = db->index[i];
+		if (!slot)
+			return NULL;
+		if (slot > db->n_recs)
+			continue;
+		rec = db->recs + slot - 1;
+		if (rec->name_hash == hash && rec->name_off < db->names_len &&
+		    !strcmp(db->names + rec->name_off, name)) {
+			db->touched[slot - 1] = true;
+			return rec;
+		}
+	}
+	return NULL;
+}
+
+struct BuildDbRecord *
+builddb_get(struct BuildDb *db, const char *name)
+{
+	struct BuildDbRecord *rec;
+	uint64_t hash;
+	void **ent;
+
+	hash = table_hash(name);
+	rec = builddb_find_mapped(db, name, hash);
+	if (rec)
+		return rec;
+	ent = table_find_hashed(&db->added, name, hash);
+	return ent ? *ent : NULL;
+}
+
+/* Find or create the record for name */
+struct BuildDbRecord *
+builddb_put(struct BuildDb *db, const char *name)
+{
+	struct BuildDbRecord *rec;
+	struct BuildDbExtra *new;
+	size_t len;
+
+	rec = builddb_get(db, name);
+	if (rec)
+		return rec;
+	len = strlen(name) + 1;
+	new = xcalloc(1, sizeof(*new) + len);
+	memcpy(new->name, name, len);
+	new->rec.name_hash = table_hash(name);
+	array_push(&db->extra, new);
+	table_insert_hashed(&db->added, new->name, new->rec.name_hash, &new->rec);
+	return &new->rec;
+}
+
+/* One record on its way out, and where its name goes */
+struct BuildDbOut {
+	const struct BuildDbRecord *rec;
+	const char *name;
+};
+
+/* Which records to save: whatever was looked up this run, and whatever is
+ * still in the graph even if this run didn't get to it. The rest are paths
+ * that were deleted or renamed away. */
+static size_t
+builddb_collect(
+	struct BuildDb *db,
+	struct Interner *keep,
+	struct BuildDbOut *out
+)
+{
+	size_t n;
+	uint32_t id;
+
+	n = 0;
+	for (uint64_t i = 0; i < db->n_recs; i++) {
+		const char *name;
+		if (db->recs[i].name_off >= db->names_len)
+			continue;
+		name = db->names + db->recs[i].name_off;
+		if (!db->touched[i] && intern_find(keep, name, &id) == -1)
+			continue;
+		out[n].rec = db->recs + i;
+		out[n++].name = name;
+	}
+	for (size_t i = 0; i < db->extra.len; i++) {
+		struct BuildDbExtra *extra = db->extra.data[i];
+		out[n].rec = &extra->rec;
+		out[n++].name = extra->name;
+	}
+	return n;
+}
+
+/* Written to a temporary file first so a crash never leaves a torn db, and
+ * one of our own so concurrent saves don't clobber each other's */
+int
+builddb_save(struct BuildDb *db, const char *path, struct Interner *keep)
+{
+	FILE *fp;
+	Str tmp_path;
+	struct BuildDbHeader hdr;
+	struct BuildDbRecord rec;
+	struct BuildDbOut *out;
+	size_t n_out;
+	uint32_t *index;
+	uint64_t name_off, total_ns, n_timed, mask, h;
+	int fd, ret;
+
+	tmp_path = str_concatraw(str_fromraw(NULL, path), ".XXXXXX");
+	fd = mkstemp(tmp_path);
+	if (fd == -1 || !(fp = fdopen(fd, "wb"))) {
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp_path);
+		}
+		str_free(tmp_path);
+		return -1;
+	}
+
+	out = xmalloc((db->n_recs + db->extra.len + 1) * sizeof(*out));
+	n_out = builddb_collect(db, keep, out);
+
+	memcpy(hdr.magic, BUILDDB_MAGIC, sizeof(hdr.magic));
+	hdr.version = BUILDDB_VERSION;
+	hdr.n_records = n_out;
+	hdr.n_slots = 0;
+	if (n_out)
+		for (hdr.n_slots = 16; hdr.n_slots < n_out * 2; hdr.n_slots *= 2)
+			;
+	total_ns = 0;
+	n_timed = 0;
+	for (size_t i = 0; i < n_out; i++) {
+		if (out[i].rec->duration_ns) {
+			total_ns += out[i].rec->duration_ns;
+			n_timed++;
+		}
+	}
+	hdr.mean_ns = n_timed ? total_ns / n_timed : 0;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	index = xcalloc(hdr.n_slots ? hdr.n_slots : 1, sizeof(*index));
+	mask = hdr.n_slots - 1;
+	name_off = 0;
+	for (size_t i = 0; i < n_out; i++) {
+		rec = *out[i].rec;
+		rec.name_off = name_off;
+		fwrite(&rec, sizeof(rec), 1, fp);
+		name_off += strlen(out[i].name) + 1;
+		for (h = rec.name_hash & mask; index[h]; h = (h + 1) & mask)
+			;
+		index[h] = (uint32_t)i + 1;
+	}
+	fwrite(index, sizeof(*index), hdr.n_slots, fp);
+	free(index);
+	for (size_t i = 0; i < n_out; i++)
+		fwrite(out[i].name, strlen(out[i].name) + 1, 1, fp);
+	free(out);
+
+	ret = 0;
+	if (ferror(fp) | fclose(fp) || rename(tmp_path, path) == -1) {
+		unlink(tmp_path);
+		ret = -1;
+	}
+	str_free(tmp_path);
+	return ret;
+}
+
+void
+builddb_destroy(struct BuildDb *db)
+{
+	for (size_t i = 0; i < db->extra.len; i++)
+		free(db->extra.data[i]);
+	array_destroy(&db->extra);
+	table_destroy(&db->added);
+	free(db->touched);
+	if (db->map)
+		munmap(db->map, db->map_len);
+	pthread_mutex_destroy(&db->mut);
+}
+
+static int
+hash_file(const char *path, uint64_t *hash)
+{
+	int fd;
+	ssize_t n;
+	uint64_t h;
+	char buf[BUILDDB_HASH_CHUNK];
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	h = 0;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		h = hash64(buf, (size_t)n, h);
+	close(fd);
+	if (n == -1)
+		return -1;
+
+	*hash = h;
+	return 0;
+}
+
+/* Content hash of path, only rereading the file if its mtime or size moved
+ * since we last hashed it. Returns -1 if it can't be read. */
+int
+builddb_file_hash(struct BuildDb *db, const char *path, uint64_t *hash)
+{
+	struct FileStat fs;
+	struct BuildDbRecord *rec;
+	int fresh;
+
+	if (statcache_get(path, &fs) == -1)
+		return -1;
+
+	pthread_mutex_lock(&db->mut);
+	rec = builddb_put(db, path);
+	fresh = (rec->flags & builddb_have_hash) &&
+		rec->mtime_sec == (int64_t)fs.mtim.tv_sec &&
+		rec->mtime_nsec == (int64_t)fs.mtim.tv_nsec &&
+		rec->size == fs.size;
+	if (fresh)
+		*hash = rec->content_hash;
+	pthread_mutex_unlock(&db->mut);
+	if (fresh)
+		return 0;
+
+	if (hash_file(path, hash) == -1)
+		return -1;
+
+	pthread_mutex_lock(&db->mut);
+	rec->flags |= builddb_have_hash;
+	rec->mtime_sec = (int64_t)fs.mtim.tv_sec;
+	rec->mtime_nsec = (int64_t)fs.mtim.tv_nsec;
+	rec->size = fs.size;
+	rec->content_hash = *hash;
+	pthread_mutex_unlock(&db->mut);
+	return 0;
+}
+
+/* Returns -1 if name was never built with the db around */
+int
+builddb_get_sig(struct BuildDb *db, const char *name, struct BuildSig *sig)
+{
+	struct BuildDbRecord *rec;
+	int ret;
+
+	pthread_mutex_lock(&db->mut);
+	rec = builddb_get(db, name);
+	ret = rec && (rec->flags & builddb_have_sig) ? 0 : -1;
+	if (!ret) {
+		sig->cmd_hash = rec->cmd_hash;
+		sig->inputs_hash = rec->inputs_hash;
+		sig->out_mtime_sec = rec->out_mtime_sec;
+		sig->out_mtime_nsec = rec->out_mtime_nsec;
+	}
+	pthread_mutex_unlock(&db->mut);
+	return ret;
+}
+
+/* Note that name is now up to date with respect to sig. A duration of 0
+ * keeps the old timing around. */
+void
+builddb_record(
+	struct BuildDb *db,
+	const char *name,
+	const struct BuildSig *sig,
+	uint64_t duration_ns
+)
+{
+	struct BuildDbRecord *rec;
+
+	pthread_mutex_lock(&db->mut);
+	rec = builddb_put(db, name);
+	rec->flags |= builddb_have_sig;
+	rec->cmd_hash = sig->cmd_hash;
+	rec->inputs_hash = sig->inputs_hash;
+	rec->out_mtime_sec = sig->out_mtime_sec;
+	rec->out_mtime_nsec = sig->out_mtime_nsec;
+	if (duration_ns)
+		rec->duration_ns = duration_ns;
+	pthread_mutex_unlock(&db->mut);
+}
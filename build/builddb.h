@@ -0,0 +1,118 @@
+#ifndef INCLUDE_BUILDDB_H
+#define INCLUDE_BUILDDB_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "intern.h"
+#include "table.h"
+#include "simpleds.h"
+
+#define BUILDDB_PATH ".construct.db"
+#define BUILDDB_MAGIC "CDB"
+#define BUILDDB_VERSION 3
+
+/* Default guess for jobs we have never timed, used until the db has any
+ * samples at all */
+#define BUILDDB_DEFAULT_NS 100000000ull
+
+/*
+ * On-disk layout, native endianness:
+ *
+ *     struct BuildDbHeader
+ *     struct BuildDbRecord[n_records]
+ *     uint32_t index[n_slots] (open addressing on name_hash, linear probing;
+ *                              1 + the record's number, 0 if empty)
+ *     char names[]            (NUL-terminated, referenced by name_off)
+ *
+ * The file is mapped privately and looked up in place, so loading costs the
+ * same however big it is, and records can be updated without touching the
+ * file; builddb_save() writes out a fresh copy of the ones still in use.
+ *
+ * Every path we have looked at gets a record: sources just cache their
+ * content hash against their mtime and size so we only rehash files that
+ * were actually touched, and targets additionally remember the command and
+ * inputs they were last built with.
+ */
+
+struct BuildDbHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t n_records;
+	uint64_t n_slots; /* a power of two, or 0 if there are no records */
+	uint64_t mean_ns; /* over the timed records, 0 if none are */
+};
+
+enum BuildDbFlags {
+	builddb_have_hash = 1 << 0, /* mtime, size and content_hash are valid */
+	builddb_have_sig = 1 << 1,  /* cmd_hash and inputs_hash are valid */
+};
+
+struct BuildDbRecord {
+	uint64_t name_off; /* from the start of the names section */
+	uint64_t name_hash;
+	uint64_t flags;
+	uint64_t duration_ns;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t size;
+	uint64_t content_hash;
+	uint64_t cmd_hash;
+	uint64_t inputs_hash;
+	int64_t out_mtime_sec; /* the output as we left it */
+	int64_t out_mtime_nsec;
+};
+
+/* What a target was (or is about to be) built from */
+struct BuildSig {
+	uint64_t cmd_hash;
+	uint64_t inputs_hash;
+	int64_t out_mtime_sec;
+	int64_t out_mtime_nsec;
+	bool complete; /* every input was hashed; not stored */
+};
+
+struct BuildDb {
+	pthread_mutex_t mut; /* guards everything below */
+	struct Table added;  /* name -> struct BuildDbRecord *, since loading */
+	struct Array extra;  /* the records in added */
+	void *map;
+	size_t map_len;
+	struct BuildDbRecord *recs; /* in the mapping */
+	uint64_t n_recs;
+	uint32_t *index;
+	uint64_t n_slots;
+	const char *names;
+	size_t names_len;
+	bool *touched; /* which of recs were looked up since loading */
+	uint64_t mean_ns;
+};
+
+void
+builddb_load(struct BuildDb *db, const char *path);
+int
+builddb_save(struct BuildDb *db, const char *path, struct Interner *keep);
+struct BuildDbRecord *
+builddb_get(struct BuildDb *db, const char *name);
+struct BuildDbRecord *
+builddb_put(struct BuildDb *db, const char *name);
+void
+builddb_destroy(struct BuildDb *db);
+
+/* Thread-safe from here on */
+
+int
+builddb_file_hash(struct BuildDb *db, const char *path, uint64_t *hash);
+int
+builddb_get_sig(struct BuildDb *db, const char *name, struct BuildSig *sig);
+void
+builddb_record(
+	struct BuildDb *db,
+	const char *name,
+	const struct BuildSig *sig,
+	uint64_t duration_ns
+);
+
+#endif
@@ -0,0 +1,469 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#	include <linux/fs.h>
+#endif
+
+#include "builddb.h"
+#include "cache.h"
+#include "simpleds.h"
+#include "util.h"
+
+/* Entry paths are DIR/ab/ + 32 hex digits */
+#define CACHE_HEX 32
+
+static atomic_uint tmp_counter;
+
+static uint64_t
+parse_size(const char *s)
+{
+	char *end;
+	uint64_t n;
+
+	n = strtoull(s, &end, 10);
+	switch (*end) {
+	case 'G': case 'g':
+		n <<= 10;
+		/* fallthrough */
+	case 'M': case 'm':
+		n <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		n <<= 10;
+	}
+	return n;
+}
+
+/* mkdir -p */
+static int
+make_dirs(const char *dir)
+{
+	char *path, *p;
+	int ret, last;
+
+	path = xstrdup(dir);
+	ret = 0;
+	for (p = path + 1;; p++) {
+		if (*p != '/' && *p != '\0')
+			continue;
+		last = *p == '\0';
+		*p = '\0';
+		if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+			ret = -1;
+			break;
+		}
+		if (last)
+			break;
+		*p = '/';
+	}
+	free(path);
+	return ret;
+}
+
+void
+cache_init(struct Cache *cache)
+{
+	const char *dir, *size;
+
+	dir = getenv(CACHE_DIR_ENV);
+	size = getenv(CACHE_SIZE_ENV);
+	cache->enabled = dir && *dir;
+	cache->dir = cache->enabled ? xstrdup(dir) : NULL;
+	cache->max_size = size && *size ? parse_size(size) : CACHE_DEFAULT_SIZE;
+	atomic_init(&cache->hits, 0);
+	atomic_init(&cache->misses, 0);
+	atomic_init(&cache->stored, 0);
+
+	if (cache->enabled && make_dirs(cache->dir) == -1) {
+		log(msgt_warn, "cache: can't create %s, not caching", cache->dir);
+		free(cache->dir);
+		cache->dir = NULL;
+		cache->enabled = false;
+	}
+}
+
+void
+cache_key(struct CacheKey *key, const char *name, const struct BuildSig *sig)
+{
+	uint64_t buf[2] = {sig->cmd_hash, sig->inputs_hash};
+
+	key->h[0] = hash64(name, strlen(name), hash64(buf, sizeof(buf), 1));
+	key->h[1] = hash64(name, strlen(name), hash64(buf, sizeof(buf), 2));
+}
+
+static void
+entry_path(struct Cache *cache, const struct CacheKey *key, Str *path)
+{
+	char hex[CACHE_HEX + 1];
+
+	snprintf(
+		hex,
+		sizeof(hex),
+		"%016llx%016llx",
+		(unsigned long long)key->h[0],
+		(unsigned long long)key->h[1]
+	);
+	*path = str_fromraw(*path, cache->dir);
+	*path = str_concatraw(*path, "/");
+	*path = str_concatlen(*path, hex, 2);
+	*path = str_concatraw(*path, "/");
+	*path = str_concatraw(*path, hex);
+}
+
+/* Somewhere next to path to build a file before renaming it over path */
+static void
+tmp_path(const char *path, Str *tmp)
+{
+	char suffix[64];
+
+	snprintf(
+		suffix,
+		sizeof(suffix),
+		".construct-tmp.%ld.%u",
+		(long)getpid(),
+		atomic_fetch_add(&tmp_counter, 1)
+	);
+	*tmp = str_fromraw(*tmp, path);
+	*tmp = str_concatraw(*tmp, suffix);
+}
+
+/* Reflinks if the filesystem can, else copies the bytes */
+static int
+copy_fd(int src, int dst)
+{
+	char buf[65536];
+	ssize_t n, w;
+
+#ifdef FICLONE
+	if (ioctl(dst, FICLONE, src) == 0)
+		return 0;
+#endif
+	while ((n = read(src, buf, sizeof(buf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (char *p = buf; n > 0; p += w, n -= w) {
+			w = write(dst, p, (size_t)n);
+			if (w == -1) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+copy_file(int src, const char *dst, mode_t mode)
+{
+	int fd, ret;
+
+	fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+	if (fd == -1)
+		return -1;
+	ret = copy_fd(src, fd);
+	if (close(fd) == -1)
+		ret = -1;
+	if (ret == -1)
+		unlink(dst);
+	return ret;
+}
+
+/* Puts the cached output for key at path, reflinked if possible and hard
+ * linked otherwise. Returns -1 on a miss. */
+int
+cache_restore(struct Cache *cache, const struct CacheKey *key, const char *path)
+{
+	Str entry, tmp;
+	struct stat sb;
+	int fd, ret;
+
+	if (!cache->enabled)
+		return -1;
+	entry = str_alloc();
+	tmp = str_alloc();
+	entry_path(cache, key, &entry);
+	tmp_path(path, &tmp);
+	ret = -1;
+
+	fd = open(entry, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &sb) == -1)
+		goto out;
+
+#ifdef FICLONE
+	{
+		int dst = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, sb.st_mode);
+		if (dst != -1) {
+			int cloned = ioctl(dst, FICLONE, fd) == 0;
+			close(dst);
+			if (cloned && rename(tmp, path) == 0) {
+				ret = 0;
+				goto out;
+			}
+			unlink(tmp);
+		}
+	}
+#endif
+	if (link(entry, tmp) == 0 || copy_file(fd, tmp, sb.st_mode) == 0) {
+		if (rename(tmp, path) == 0)
+			ret = 0;
+		else
+			unlink(tmp);
+	}
+
+out:
+	if (fd != -1)
+		close(fd);
+	if (ret == 0) {
+		/* Bump it for LRU. A hard-linked output shares the inode with other
+		 * worktrees, whose signatures hold its mtime, so only touch atime. */
+		struct timespec ts[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+		utimensat(AT_FDCWD, entry, ts, 0);
+		atomic_fetch_add(&cache->hits, 1);
+	} else {
+		atomic_fetch_add(&cache->misses, 1);
+	}
+	str_free(entry);
+	str_free(tmp);
+	return ret;
+}
+
+/* Copies path into the cache under key; a racing store of the same key just
+ * replaces it with identical contents */
+int
+cache_store(struct Cache *cache, const struct CacheKey *key, const char *path)
+{
+	Str entry, tmp;
+	struct stat sb;
+	int fd, ret;
+
+	if (!cache->enabled)
+		return 0;
+	entry = str_alloc();
+	tmp = str_alloc();
+	entry_path(cache, key, &entry);
+	ret = -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode))
+		goto out;
+
+	/* The ab/ directory might not be there yet */
+	entry[str_len(entry) - CACHE_HEX - 1] = '\0';
+	if (mkdir(entry, 0777) == -1 && errno != EEXIST)
+		goto out;
+	entry[str_len(entry) - CACHE_HEX - 1] = '/';
+
+	tmp_path(entry, &tmp);
+	if (copy_file(fd, tmp, sb.st_mode & 0777) == -1)
+		goto out;
+	if (rename(tmp, entry) == -1) {
+		unlink(tmp);
+		goto out;
+	}
+	atomic_fetch_add(&cache->stored, (uint_fast64_t)sb.st_size);
+	ret = 0;
+
+out:
+	if (fd != -1)
+		close(fd);
+	str_free(entry);
+	str_free(tmp);
+	return ret;
+}
+
+/* If path is hard linked to anything (i.e. the cache), unlink it so the job
+ * about to rebuild it can't write through into the cache entry */
+void
+cache_detach(const char *path)
+{
+	struct stat sb;
+
+	if (lstat(path, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_nlink > 1)
+		unlink(path);
+}
+
+struct CacheFile {
+	char *path;
+	struct timespec atim;
+	uint64_t size;
+};
+
+static int
+cachefile_cmp(const void *_a, const void *_b)
+{
+	const struct CacheFile *a = _a, *b = _b;
+
+	if (a->atim.tv_sec != b->atim.tv_sec)
+		return a->atim.tv_sec < b->atim.tv_sec ? -1 : 1;
+	if (a->atim.tv_nsec != b->atim.tv_nsec)
+		return a->atim.tv_nsec < b->atim.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* Collects every entry in one ab/ directory, clearing out old temporaries */
+static void
+scan_dir(const char *dir, struct CacheFile **files, size_t *n, size_t *cap)
+{
+	DIR *dp;
+	struct dirent *de;
+	struct stat sb;
+	Str path;
+	time_t now;
+
+	dp = opendir(dir);
+	if (!dp)
+		return;
+	path = str_alloc();
+	now = time(NULL);
+	while ((de = readdir(dp))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		path = str_fromraw(path, dir);
+		path = str_concatraw(path, "/");
+		path = str_concatraw(path, de->d_name);
+		if (stat(path, &sb) == -1 || !S_ISREG(sb.st_mode))
+			continue;
+		if (strlen(de->d_name) != CACHE_HEX) {
+			if (now - ST_MTIM(sb).tv_sec > CACHE_STALE_TMP_SEC)
+				unlink(path);
+			continue;
+		}
+		if (*n == *cap) {
+			*cap = *cap ? *cap * 2 : 256;
+			*files = xrealloc(*files, *cap * sizeof(**files));
+		}
+		(*files)[*n].path = xstrdup(path);
+		(*files)[*n].atim = ST_ATIM(sb);
+		(*files)[*n].size = (uint64_t)sb.st_size;
+		(*n)++;
+	}
+	str_free(path);
+	closedir(dp);
+}
+
+/* Returns -1 if the total is missing or mangled, and has to be recounted */
+static int
+read_total(int fd, uint64_t *total)
+{
+	char buf[32], *end;
+	ssize_t n;
+
+	n = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	*total = strtoull(buf, &end, 10);
+	return end != buf && *end == '\n' ? 0 : -1;
+}
+
+static void
+write_total(int fd, uint64_t total)
+{
+	char buf[32];
+	int n;
+
+	n = snprintf(buf, sizeof(buf), "%llu\n", (unsigned long long)total);
+	if (pwrite(fd, buf, (size_t)n, 0) == n)
+		ftruncate(fd, n);
+}
+
+/* Adds what we stored to the running total, and only if that goes over
+ * max_size looks at the entries themselves, evicting the least recently
+ * used until the cache fits. The total can only drift upwards (e.g. when two
+ * builds store the same entry), which just means recounting a bit early. */
+void
+cache_trim(struct Cache *cache)
+{
+	struct flock lk;
+	struct CacheFile *files;
+	size_t n, cap, i;
+	uint64_t added, total;
+	Str path;
+	char sub[3];
+	int fd, size_fd;
+
+	if (!cache->enabled || !(added = atomic_exchange(&cache->stored, 0)))
+		return;
+
+	path = str_fromraw(str_alloc(), cache->dir);
+	path = str_concatraw(path, "/" CACHE_LOCK);
+	size_fd = -1;
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd == -1)
+		goto out;
+	memset(&lk, 0, sizeof(lk));
+	lk.l_type = F_WRLCK;
+	lk.l_whence = SEEK_SET;
+	while (fcntl(fd, F_SETLKW, &lk) == -1)
+		if (errno != EINTR)
+			goto out;
+
+	path = str_fromraw(path, cache->dir);
+	path = str_concatraw(path, "/" CACHE_SIZE_FILE);
+	size_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (size_fd == -1)
+		goto out;
+	if (read_total(size_fd, &total) == 0) {
+		total += added;
+		if (total <= cache->max_size) {
+			write_total(size_fd, total);
+			goto out;
+		}
+	}
+
+	files = NULL;
+	n = cap = 0;
+	for (unsigned b = 0; b < 256; b++) {
+		snprintf(sub, sizeof(sub), "%02x", b);
+		path = str_fromraw(path, cache->dir);
+		path = str_concatraw(path, "/");
+		path = str_concatraw(path, sub);
+		scan_dir(path, &files, &n, &cap);
+	}
+
+	total = 0;
+	for (i = 0; i < n; i++)
+		total += files[i].size;
+	if (total > cache->max_size) {
+		qsort(files, n, sizeof(*files), cachefile_cmp);
+		for (i = 0; i < n && total > cache->max_size; i++)
+			if (unlink(files[i].path) == 0)
+				total -= files[i].size;
+	}
+
+	write_total(size_fd, total);
+
+	for (i = 0; i < n; i++)
+		free(files[i].path);
+	free(files);
+
+out:
+	if (size_fd != -1)
+		close(size_fd);
+	if (fd != -1)
+		close(fd); /* drops the lock */
+	str_free(path);
+}
+
+void
+cache_destroy(struct Cache *cache)
+{
+	free(cache->dir);
+}
@@ -0,0 +1,75 @@
+#ifndef INCLUDE_CACHE_H
+#define INCLUDE_CACHE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "builddb.h"
+
+/* Set to a directory to turn the cache on; it may be shared by any number of
+ * builds at once */
+#define CACHE_DIR_ENV "CONSTRUCT_CACHE_DIR"
+/* Bytes, with an optional K, M or G suffix */
+#define CACHE_SIZE_ENV "CONSTRUCT_CACHE_SIZE"
+#define CACHE_DEFAULT_SIZE (1ull << 30)
+#define CACHE_LOCK ".lock"
+/* Running total of the entries' sizes, kept under the lock so that trimming
+ * only has to look at them once it goes over */
+#define CACHE_SIZE_FILE ".size"
+/* Temporaries older than this were left behind by a build that died */
+#define CACHE_STALE_TMP_SEC 3600
+
+/*
+ * Content-addressed store of job outputs. A job is keyed by its command, the
+ * contents of its dependencies and its output path, and its output lives in
+ * DIR/ab/abcd... Entries are only ever created by renaming a finished file
+ * into place, so readers never see half of one.
+ *
+ * Restored outputs may be hard links into the cache, which is why anything
+ * about to be rebuilt must first go through cache_detach. Least recently used
+ * entries are evicted by atime, which a hit bumps; mtime is left alone, since
+ * every worktree sharing the inode has it recorded.
+ */
+
+struct CacheKey {
+	uint64_t h[2];
+};
+
+struct Cache {
+	bool enabled;
+	char *dir;
+	uint64_t max_size;
+	atomic_size_t hits;
+	atomic_size_t misses;
+	atomic_uint_fast64_t stored; /* bytes added since the last trim */
+};
+
+void
+cache_init(struct Cache *cache);
+void
+cache_key(
+	struct CacheKey *key,
+	const char *name,
+	const struct BuildSig *sig
+);
+void
+cache_trim(struct Cache *cache);
+void
+cache_destroy(struct Cache *cache);
+
+/* Thread-safe from here on */
+
+int
+cache_restore(
+	struct Cache *cache,
+	const struct CacheKey *key,
+	const char *path
+);
+int
+cache_store(struct Cache *cache, const struct CacheKey *key, const char *path);
+void
+cache_detach(const char *path);
+
+#endif
@@ -2,6 +2,8 @@
 #define INCLUDE_DSL_H
 
 #include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
 
 #include "build.h"
 #include "target.h"
@@ -16,32 +18,42 @@
 		_dbg_file_global = NULL;     \
 	} while (0)
 
-#define construction_site(graph)              \
-	struct Depgraph graph, *_construct_graph; \
-	_construct_graph = &graph;                \
-	graph_init(_construct_graph);             \
-	(void)argc;                               \
-	(void)argv; // later
+#define construction_site(graph)                       \
+	struct Depgraph graph, *_construct_graph;          \
+	bool _construct_watch;                             \
+	_construct_graph = &graph;                         \
+	graph_init(_construct_graph);                      \
+	_construct_watch = _construct_parse_args(argc, argv);
 
 #define construction_done() graph_destroy(_construct_graph);
 
+/* With -w, builds and then keeps rebuilding as sources change */
 #define construct(targ_name, njobs)                                   \
-	_DSL_DECL_STMT(graph_build(                                       \
+	_DSL_DECL_STMT((_construct_watch ? graph_watch : graph_build)(    \
 					   _construct_graph,                              \
 					   graph_get_target(_construct_graph, targ_name), \
 					   njobs                                          \
 	);)
 
-#define target(_targ_rule, _targ_deps, _targ_frags)    \
-	graph_add_target(                                  \
-		_construct_graph,                              \
-		target_from_rule(make_rule(                    \
-			FRAG_CONSTRUCTOR(target)(_targ_rule),      \
-			_targ_deps,                                \
-			(struct FragBase *[])_targ_frags,          \
-			sizeof((struct FragBase *[])_targ_frags) / \
-				sizeof(struct FragBase *)              \
-		))                                             \
+/* Everything the DSL builds lives as long as the graph does */
+#define _CONSTRUCT_ARENA (&_construct_graph->arena)
+#define _CONSTRUCT_PATHS (&_construct_graph->paths)
+
+#define target(_targ_rule, _targ_deps, _targ_frags)                     \
+	graph_add_target(                                                   \
+		_construct_graph,                                               \
+		target_from_rule(                                               \
+			_CONSTRUCT_ARENA,                                           \
+			make_rule(                                                  \
+				_CONSTRUCT_ARENA,                                       \
+				FRAG_CONSTRUCTOR(target)(_CONSTRUCT_PATHS, _targ_rule), \
+				_targ_deps,                                             \
+				(struct FragBase *[])_targ_frags,                       \
+				sizeof((struct FragBase *[])_targ_frags) /              \
+					sizeof(struct FragBase *)                           \
+			),                                                          \
+			&_construct_graph->dep_ids                                  \
+		)                                                               \
 	)
 
 #define ARRAY(...) {__VA_ARGS__}
@@ -51,33 +63,51 @@
 
 #define _0 ),
 #define _ _0 l " "_0
-#define need(_dep) FRAG_CONSTRUCTOR(dep)(_dep)
+#define need(_dep) FRAG_CONSTRUCTOR(dep)(_CONSTRUCT_PATHS, _dep)
 #define needs(...)                                                    \
 	_needs_impl(                                                      \
+		_CONSTRUCT_PATHS,                                             \
 		sizeof((const char *[]){__VA_ARGS__}) / sizeof(const char *), \
 		__VA_ARGS__                                                   \
 	)
 
 #define _FCONSTR(_frag_type) (struct FragBase *)FRAG_CONSTRUCTOR(_frag_type)
-#define l _FCONSTR(lit)(
-#define depn _FCONSTR(depidx)(
-#define alldeps() _FCONSTR(alldeps)(
+#define l _FCONSTR(lit)(_CONSTRUCT_ARENA,
+#define depn _FCONSTR(depidx)(_CONSTRUCT_ARENA,
+#define alldeps() _FCONSTR(alldeps)(_CONSTRUCT_ARENA
 #define firstdep() depn(1)
 #define targ() depn(0)
+/* Commands are exec'd directly unless one of their fragments is shell() */
+#define shell() _FCONSTR(shell)(_CONSTRUCT_ARENA),
+
+/* Returns whether we were asked to watch */
+static bool
+_construct_parse_args(int argc, char **argv)
+{
+	bool watch = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--watch"))
+			watch = true;
+		else
+			die("usage: %s [-w]", argv[0]);
+	}
+	return watch;
+}
 
-struct Array *
-_needs_impl(size_t n, ...)
+struct DepList *
+_needs_impl(struct Interner *paths, size_t n, ...)
 {
-	struct Array *deps;
+	struct DepList *deps;
 	va_list args;
 
-	deps = xmalloc(sizeof(*deps));
-	array_init(deps);
+	deps = arena_alloc(paths->arena, sizeof(*deps) + n * sizeof(*deps->data));
+	deps->len = n;
 	va_start(args, n);
 	for (size_t i = 0; i < n; ++i) {
 		const char *s;
 		s = va_arg(args, const char *);
-		array_push(deps, FRAG_CONSTRUCTOR(dep)(s));
+		deps->data[i] = FRAG_CONSTRUCTOR(dep)(paths, s);
 	}
 	va_end(args);
 	return deps;
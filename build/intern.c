@@ -0,0 +1,58 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "intern.h"
+#include "simpleds.h"
+#include "table.h"
+#include "util.h"
+
+void
+interner_init(struct Interner *in, struct Arena *arena)
+{
+	table_init(&in->index);
+	array_init(&in->strs);
+	in->arena = arena;
+}
+
+/* The strings themselves go when the arena does */
+void
+interner_destroy(struct Interner *in)
+{
+	array_destroy(&in->strs);
+	table_destroy(&in->index);
+}
+
+/* Returns the id of s, adding it if we haven't seen it before */
+uint32_t
+intern(struct Interner *in, const char *s)
+{
+	uint64_t hash;
+	void **ent;
+	char *copy;
+	uint32_t id;
+
+	hash = table_hash(s);
+	ent = table_find_hashed(&in->index, s, hash);
+	if (ent)
+		return (uint32_t)(uintptr_t)*ent;
+
+	copy = arena_strdup(in->arena, s);
+	id = (uint32_t)in->strs.len;
+	array_push(&in->strs, copy);
+	table_insert_hashed(&in->index, copy, hash, (void *)(uintptr_t)id);
+	return id;
+}
+
+/* Returns -1 if s was never interned */
+int
+intern_find(struct Interner *in, const char *s, uint32_t *id)
+{
+	void **ent;
+
+	ent = table_find(&in->index, s);
+	if (!ent)
+		return -1;
+	*id = (uint32_t)(uintptr_t)*ent;
+	return 0;
+}
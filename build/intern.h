@@ -0,0 +1,39 @@
+#ifndef INCLUDE_INTERN_H
+#define INCLUDE_INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "simpleds.h"
+#include "table.h"
+
+/* Stores each distinct string once and numbers them densely from 0 */
+struct Interner {
+	struct Table index; /* string -> (uintptr_t)id */
+	struct Array strs;  /* id -> string */
+	struct Arena *arena; /* where the strings live */
+};
+
+void
+interner_init(struct Interner *in, struct Arena *arena);
+void
+interner_destroy(struct Interner *in);
+uint32_t
+intern(struct Interner *in, const char *s);
+int
+intern_find(struct Interner *in, const char *s, uint32_t *id);
+
+static inline const char *
+interned(struct Interner *in, uint32_t id)
+{
+	return in->strs.data[id];
+}
+
+static inline uint32_t
+interner_len(struct Interner *in)
+{
+	return (uint32_t)in->strs.len;
+}
+
+#endif
@@ -0,0 +1,251 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jobserver.h"
+#include "util.h"
+
+static int
+open_fifo(struct Jobserver *js, const char *path)
+{
+	js->rfd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (js->rfd == -1)
+		return -1;
+	js->wfd = js->own_fd = js->rfd;
+	return 0;
+}
+
+static bool
+fd_valid(int fd)
+{
+	return fd >= 0 && fcntl(fd, F_GETFD) != -1;
+}
+
+/* The read end of a pipe is shared with make and everyone else, so it may
+ * well be blocking, and a token can vanish between poll() and read().
+ * Reopening it gets us a description of our own to make non-blocking,
+ * without changing it for anyone else. */
+static int
+reopen_nonblocking(struct Jobserver *js)
+{
+	char path[32];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", js->rfd);
+	js->own_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (js->own_fd == -1)
+		return -1;
+	js->rfd = js->own_fd;
+	return 0;
+}
+
+/* Finds make's --jobserver-auth (or the older --jobserver-fds) in MAKEFLAGS.
+ * The last one wins, like in make. */
+static int
+jobserver_client(struct Jobserver *js)
+{
+	const char *flags, *p, *auth;
+	char path[4096];
+	size_t n;
+
+	flags = getenv("MAKEFLAGS");
+	if (!flags)
+		return -1;
+	auth = NULL;
+	for (p = flags; (p = strstr(p, "--jobserver-")); p++)
+		if (!strncmp(p, "--jobserver-auth=", 17))
+			auth = p + 17;
+		else if (!strncmp(p, "--jobserver-fds=", 16))
+			auth = p + 16;
+	if (!auth)
+		return -1;
+
+	if (!strncmp(auth, "fifo:", 5)) {
+		n = strcspn(auth + 5, " ");
+		if (n >= sizeof(path))
+			return -1;
+		memcpy(path, auth + 5, n);
+		path[n] = '\0';
+		if (open_fifo(js, path) == -1) {
+			log(msgt_warn, "jobserver: can't open %s, ignoring it", path);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (sscanf(auth, "%d,%d", &js->rfd, &js->wfd) != 2)
+		return -1;
+	if (!fd_valid(js->rfd) || !fd_valid(js->wfd)) {
+		log(
+			msgt_warn,
+			"jobserver: fds %d,%d aren't open (is the rule missing a '+'?), "
+			"ignoring them",
+			js->rfd,
+			js->wfd
+		);
+		return -1;
+	}
+
+	/* Reading from it as is could hang, so go it alone instead */
+	if (reopen_nonblocking(js) == -1) {
+		log(
+			msgt_warn,
+			"jobserver: can't reopen fd %d non-blocking, ignoring it",
+			js->rfd
+		);
+		return -1;
+	}
+	return 0;
+}
+
+/* A pipe with a token for every slot but our own implicit one, advertised to
+ * the jobs we spawn through MAKEFLAGS. Its fds are left open across exec,
+ * and go in the R,W form, since make only understands fifo: from 4.4 on. */
+static int
+jobserver_server(struct Jobserver *js, unsigned max_jobs)
+{
+	const char *old;
+	char *flags;
+	size_t len;
+
+	if (pipe(js->pipe_fds) == -1)
+		return -1;
+	js->rfd = js->pipe_fds[0];
+	js->wfd = js->pipe_fds[1];
+	old = getenv("MAKEFLAGS");
+	js->old_makeflags = old ? xstrdup(old) : NULL;
+	js->server = true;
+
+	for (unsigned i = 1; i < max_jobs; i++)
+		if (write(js->wfd, "+", 1) != 1)
+			return -1;
+	if (reopen_nonblocking(js) == -1)
+		return -1;
+
+	/* Later flags win, so just tack ours on the end. Make before 4.2 only
+	 * knows --jobserver-fds. */
+	len = (old ? strlen(old) : 0) +
+		sizeof(" -j --jobserver-fds=, --jobserver-auth=,") + 10 + 4 * 11;
+	flags = xmalloc(len);
+	snprintf(
+		flags,
+		len,
+		"%s -j%u --jobserver-fds=%d,%d --jobserver-auth=%d,%d",
+		old ? old : "",
+		max_jobs,
+		js->pipe_fds[0],
+		js->pipe_fds[1],
+		js->pipe_fds[0],
+		js->pipe_fds[1]
+	);
+	setenv("MAKEFLAGS", flags, 1);
+	free(flags);
+	return 0;
+}
+
+void
+jobserver_init(struct Jobserver *js, unsigned max_jobs)
+{
+	js->active = false;
+	js->server = false;
+	js->rfd = js->wfd = js->own_fd = -1;
+	js->pipe_fds[0] = js->pipe_fds[1] = -1;
+	js->old_makeflags = NULL;
+	js->implicit_free = true;
+	pthread_mutex_init(&js->mut, NULL);
+
+	if (jobserver_client(js) == 0) {
+		js->active = true;
+	} else if (max_jobs > 1) {
+		if (jobserver_server(js, max_jobs) == -1) {
+			log(msgt_warn, "jobserver: failed to set up a pipe", 0);
+			jobserver_destroy(js);
+			jobserver_init(js, 1);
+			return;
+		}
+		js->active = true;
+	}
+}
+
+static bool
+take_implicit(struct Jobserver *js)
+{
+	bool took;
+	pthread_mutex_lock(&js->mut);
+	took = js->implicit_free;
+	js->implicit_free = false;
+	pthread_mutex_unlock(&js->mut);
+	return took;
+}
+
+/* Blocks until we're allowed to run a job, returning the token to hand back
+ * to jobserver_release. Waiters wake up now and then to check whether our
+ * implicit slot came free, since nobody writes to the pipe when it does. */
+int
+jobserver_acquire(struct Jobserver *js)
+{
+	struct pollfd pfd;
+	unsigned char token;
+	ssize_t n;
+
+	if (!js->active || take_implicit(js))
+		return JOBSERVER_IMPLICIT;
+
+	pfd.fd = js->rfd;
+	pfd.events = POLLIN;
+	for (;;) {
+		if (poll(&pfd, 1, JOBSERVER_POLL_MS) == -1 && errno != EINTR)
+			die("jobserver: poll failed: %s", strerror(errno));
+		if (pfd.revents & (POLLIN | POLLHUP)) {
+			n = read(js->rfd, &token, 1);
+			if (n == 1)
+				return token;
+			if (n == 0)
+				die("jobserver: pipe closed", 0);
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				die("jobserver: read failed: %s", strerror(errno));
+		}
+		if (take_implicit(js))
+			return JOBSERVER_IMPLICIT;
+	}
+}
+
+void
+jobserver_release(struct Jobserver *js, int token)
+{
+	unsigned char c = (unsigned char)token;
+
+	if (!js->active)
+		return;
+	if (token == JOBSERVER_IMPLICIT) {
+		pthread_mutex_lock(&js->mut);
+		js->implicit_free = true;
+		pthread_mutex_unlock(&js->mut);
+		return;
+	}
+	while (write(js->wfd, &c, 1) != 1)
+		if (errno != EINTR && errno != EAGAIN)
+			die("jobserver: failed to return a token: %s", strerror(errno));
+}
+
+void
+jobserver_destroy(struct Jobserver *js)
+{
+	if (js->server) {
+		if (js->old_makeflags)
+			setenv("MAKEFLAGS", js->old_makeflags, 1);
+		else
+			unsetenv("MAKEFLAGS");
+		free(js->old_makeflags);
+		close(js->pipe_fds[0]);
+		close(js->pipe_fds[1]);
+	}
+	if (js->own_fd != -1)
+		close(js->own_fd);
+	pthread_mutex_destroy(&js->mut);
+}
@@ -0,0 +1,42 @@
+#ifndef INCLUDE_JOBSERVER_H
+#define INCLUDE_JOBSERVER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* Token meaning "the slot every process gets for free", never written back */
+#define JOBSERVER_IMPLICIT 256
+/* How long a waiting worker sleeps before checking the implicit slot again */
+#define JOBSERVER_POLL_MS 100
+
+/*
+ * GNU make's jobserver protocol: a pipe or fifo holding one byte per free job
+ * slot, shared by every process in the build. A job takes a byte before it
+ * runs and writes it back after, and each process also has one implicit slot
+ * that isn't in the pipe.
+ *
+ * If make started us with --jobserver-auth we're a client of its pipe,
+ * otherwise we serve our own to the jobs we spawn.
+ */
+struct Jobserver {
+	bool active;
+	bool server;
+	int rfd;             /* always non-blocking */
+	int wfd;
+	int own_fd;          /* one we opened and have to close, or -1 */
+	int pipe_fds[2];     /* serving only: what the jobs inherit */
+	char *old_makeflags; /* to put back after serving */
+	pthread_mutex_t mut;
+	bool implicit_free;
+};
+
+void
+jobserver_init(struct Jobserver *js, unsigned max_jobs);
+int
+jobserver_acquire(struct Jobserver *js);
+void
+jobserver_release(struct Jobserver *js, int token);
+void
+jobserver_destroy(struct Jobserver *js);
+
+#endif
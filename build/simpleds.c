@@ -67,9 +67,10 @@ array_init(struct Array *arr)
 void
 array_push(struct Array *arr, void *item)
 {
-	if (arr->len == arr->_cap)
+	if (arr->len == arr->_cap) {
 		arr->_cap *= 2;
-	arr->data = xrealloc(arr->data, arr->_cap * sizeof(*arr->data));
+		arr->data = xrealloc(arr->data, arr->_cap * sizeof(*arr->data));
+	}
 	arr->data[arr->len++] = item;
 }
 
@@ -85,6 +86,108 @@ array_destroy(struct Array *arr)
 	free(arr->data);
 }
 
+void
+idarray_init(struct IdArray *arr)
+{
+	arr->len = 0;
+	arr->_cap = 16;
+	arr->data = xmalloc(arr->_cap * sizeof(*arr->data));
+}
+
+void
+idarray_push(struct IdArray *arr, uint32_t id)
+{
+	if (arr->len == arr->_cap) {
+		arr->_cap *= 2;
+		arr->data = xrealloc(arr->data, arr->_cap * sizeof(*arr->data));
+	}
+	arr->data[arr->len++] = id;
+}
+
+/* Grow or shrink to exactly len ids; new ones are left uninitialised */
+void
+idarray_resize(struct IdArray *arr, size_t len)
+{
+	if (len > arr->_cap) {
+		while (arr->_cap < len)
+			arr->_cap *= 2;
+		arr->data = xrealloc(arr->data, arr->_cap * sizeof(*arr->data));
+	}
+	arr->len = len;
+}
+
+void
+idarray_destroy(struct IdArray *arr)
+{
+	free(arr->data);
+}
+
+void
+heap_init(struct Heap *heap)
+{
+	heap->len = 0;
+	heap->_cap = 16;
+	heap->data = xmalloc(heap->_cap * sizeof(*heap->data));
+}
+
+void
+heap_push(struct Heap *heap, uint64_t prio, void *val)
+{
+	size_t i;
+
+	if (heap->len == heap->_cap) {
+		heap->_cap *= 2;
+		heap->data = xrealloc(heap->data, heap->_cap * sizeof(*heap->data));
+	}
+
+	/* Sift up */
+	i = heap->len++;
+	while (i > 0 && heap->data[(i - 1) / 2].prio < prio) {
+		heap->data[i] = heap->data[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap->data[i].prio = prio;
+	heap->data[i].val = val;
+}
+
+void *
+heap_pop(struct Heap *heap)
+{
+	void *top;
+	struct HeapEntry last;
+	size_t i, child;
+
+	top = heap->data[0].val;
+	last = heap->data[--heap->len];
+
+	/* Sift the last entry down from the root */
+	i = 0;
+	while ((child = 2 * i + 1) < heap->len) {
+		if (child + 1 < heap->len &&
+		    heap->data[child + 1].prio > heap->data[child].prio)
+			child++;
+		if (heap->data[child].prio <= last.prio)
+			break;
+		heap->data[i] = heap->data[child];
+		i = child;
+	}
+	heap->data[i] = last;
+
+	return top;
+}
+
+size_t
+heap_len(struct Heap *heap)
+{
+	return heap->len;
+}
+
+void
+heap_destroy(struct Heap *heap)
+{
+	free(heap->data);
+}
+
 #define FROM_BUF(s) (s - sizeof(size_t))
 #define TO_BUF(s) (s + sizeof(size_t))
 #define BUF_LEN(s) ((size_t *)FROM_BUF(s))
@@ -158,6 +261,19 @@ str_concatraw(Str restrict dest, const char *restrict src)
 	return ns;
 }
 
+Str
+str_concatlen(Str restrict dest, const char *restrict src, size_t len)
+{
+	Str ns;
+	size_t dest_len;
+	dest_len = *BUF_LEN(dest);
+	ns = str_growto(dest, dest_len + len);
+	memcpy(ns + dest_len, src, len);
+	ns[dest_len + len] = '\0';
+	*BUF_LEN(ns) = dest_len + len;
+	return ns;
+}
+
 Str
 str_merge(Str restrict dest, Str restrict src)
 {
@@ -187,3 +303,15 @@ str_dupl(Str s)
 	*BUF_LEN(ns) = *BUF_LEN(s);
 	return ns;
 }
+
+/* A Str of len uninitialised chars that lives and dies with the arena; it
+ * must never be freed or grown */
+Str
+str_arena(struct Arena *arena, size_t len)
+{
+	char *s;
+	s = arena_alloc(arena, sizeof(size_t) + len + 1);
+	*(size_t *)s = len;
+	s[sizeof(size_t) + len] = '\0';
+	return TO_BUF(s);
+}
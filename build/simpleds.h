@@ -2,6 +2,9 @@
 #define INCLUDE_SIMPLEDS_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
 
 /* See https://github.com/tux314159/queuebench;
  * these are really, really fast. */
@@ -38,6 +41,47 @@ array_pop(struct Array *arr);
 void
 array_destroy(struct Array *arr);
 
+/* Like Array, but of packed 32-bit ids */
+
+struct IdArray {
+	size_t len;
+	size_t _cap;
+	uint32_t *data;
+};
+
+void
+idarray_init(struct IdArray *arr);
+void
+idarray_push(struct IdArray *arr, uint32_t id);
+void
+idarray_resize(struct IdArray *arr, size_t len);
+void
+idarray_destroy(struct IdArray *arr);
+
+/* Binary max-heap keyed on a 64-bit priority */
+
+struct HeapEntry {
+	uint64_t prio;
+	void *val;
+};
+
+struct Heap {
+	size_t len;
+	size_t _cap;
+	struct HeapEntry *data;
+};
+
+void
+heap_init(struct Heap *heap);
+void
+heap_push(struct Heap *heap, uint64_t prio, void *val);
+void *
+heap_pop(struct Heap *heap);
+size_t
+heap_len(struct Heap *heap);
+void
+heap_destroy(struct Heap *heap);
+
 typedef char *Str;
 
 Str
@@ -55,10 +99,14 @@ str_concat(Str restrict dest, Str restrict src);
 Str
 str_concatraw(Str restrict dest, const char *restrict src);
 Str
+str_concatlen(Str restrict dest, const char *restrict src, size_t len);
+Str
 str_merge(Str restrict dest, Str restrict src);
 Str
 str_fromraw(Str restrict s, const char *restrict buf);
 Str
 str_dupl(Str s);
+Str
+str_arena(struct Arena *arena, size_t len);
 
 #endif
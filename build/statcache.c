@@ -0,0 +1,177 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "simpleds.h"
+#include "statcache.h"
+#include "table.h"
+#include "threadpool.h"
+#include "util.h"
+
+struct StatShard {
+	pthread_mutex_t mut;
+	struct Table entries; /* path -> struct StatEntry * */
+};
+
+struct StatEntry {
+	struct FileStat fs;
+	char path[]; /* the key lives here */
+};
+
+static struct StatShard shards[STATCACHE_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static atomic_size_t n_hits, n_misses;
+
+static void
+shards_init(void)
+{
+	for (size_t i = 0; i < STATCACHE_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].mut, NULL);
+		table_init(&shards[i].entries);
+	}
+}
+
+static struct StatShard *
+shard_for(const char *path)
+{
+	pthread_once(&shards_once, shards_init);
+	return shards + (hash64(path, strlen(path), 0) % STATCACHE_SHARDS);
+}
+
+/* Returns -1 if path doesn't exist (fs->exists is cleared too) */
+int
+statcache_get(const char *path, struct FileStat *fs)
+{
+	struct StatShard *shard;
+	struct StatEntry **ent, *new;
+	struct stat sb;
+	size_t len;
+
+	shard = shard_for(path);
+	pthread_mutex_lock(&shard->mut);
+	ent = (struct StatEntry **)table_find(&shard->entries, path);
+	if (ent)
+		*fs = (*ent)->fs;
+	pthread_mutex_unlock(&shard->mut);
+	if (ent) {
+		n_hits++;
+		return fs->exists ? 0 : -1;
+	}
+
+	/* Don't hold the shard while we go to disk */
+	n_misses++;
+	if (stat(path, &sb) == -1) {
+		fs->exists = false;
+		fs->mtim.tv_sec = 0;
+		fs->mtim.tv_nsec = 0;
+		fs->size = 0;
+	} else {
+		fs->exists = true;
+		fs->mtim = ST_MTIM(sb);
+		fs->size = (uint64_t)sb.st_size;
+	}
+
+	len = strlen(path) + 1;
+	new = xmalloc(sizeof(*new) + len);
+	new->fs = *fs;
+	memcpy(new->path, path, len);
+	pthread_mutex_lock(&shard->mut);
+	ent = (struct StatEntry **)table_find(&shard->entries, path);
+	if (ent) { /* somebody beat us to it */
+		table_delete(&shard->entries, path);
+		free(*ent);
+	}
+	table_insert(&shard->entries, new->path, new);
+	pthread_mutex_unlock(&shard->mut);
+
+	return fs->exists ? 0 : -1;
+}
+
+void
+statcache_invalidate(const char *path)
+{
+	struct StatShard *shard;
+	struct StatEntry **ent;
+
+	shard = shard_for(path);
+	pthread_mutex_lock(&shard->mut);
+	ent = (struct StatEntry **)table_find(&shard->entries, path);
+	if (ent) {
+		struct StatEntry *old = *ent;
+		table_delete(&shard->entries, path);
+		free(old);
+	}
+	pthread_mutex_unlock(&shard->mut);
+}
+
+struct PrefetchArg {
+	const char **paths;
+	size_t n;
+};
+
+static void
+prefetch_chunk(void *_args)
+{
+	struct PrefetchArg *args = _args;
+	struct FileStat fs;
+
+	for (size_t i = 0; i < args->n; i++)
+		statcache_get(args->paths[i], &fs);
+}
+
+/* Stat a whole batch of paths in parallel */
+void
+statcache_prefetch(const char **paths, size_t n)
+{
+	struct ThreadPool pool;
+	struct PrefetchArg args;
+	size_t n_chunks, n_threads;
+
+	n_chunks = (n + STATCACHE_PREFETCH_CHUNK - 1) /
+		STATCACHE_PREFETCH_CHUNK;
+	if (n_chunks == 0)
+		return;
+	n_threads = n_chunks < STATCACHE_PREFETCH_THREADS
+		? n_chunks
+		: STATCACHE_PREFETCH_THREADS;
+
+	threadpool_init(&pool, n_threads, sizeof(args));
+	for (size_t i = 0; i < n; i += STATCACHE_PREFETCH_CHUNK) {
+		args.paths = paths + i;
+		args.n = n - i < STATCACHE_PREFETCH_CHUNK
+			? n - i
+			: STATCACHE_PREFETCH_CHUNK;
+		threadpool_execute(&pool, &prefetch_chunk, &args);
+	}
+	threadpool_wait(&pool);
+	threadpool_destroy(&pool);
+}
+
+/* Forget everything and reset the counters */
+void
+statcache_clear(void)
+{
+	pthread_once(&shards_once, shards_init);
+	for (size_t i = 0; i < STATCACHE_SHARDS; i++) {
+		pthread_mutex_lock(&shards[i].mut);
+		TABLE_ITER(&shards[i].entries, it) {
+			TABLE_ITER_SKIP_INVALID(&shards[i].entries, it);
+			free(it->val);
+		}
+		table_destroy(&shards[i].entries);
+		table_init(&shards[i].entries);
+		pthread_mutex_unlock(&shards[i].mut);
+	}
+	n_hits = 0;
+	n_misses = 0;
+}
+
+void
+statcache_counters(size_t *hits, size_t *misses)
+{
+	*hits = n_hits;
+	*misses = n_misses;
+}
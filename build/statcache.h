@@ -0,0 +1,41 @@
+#ifndef INCLUDE_STATCACHE_H
+#define INCLUDE_STATCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "simpleds.h"
+
+/* Split over this many independently locked tables to keep workers from
+ * contending on a single lock */
+#define STATCACHE_SHARDS 64
+/* stat() is mostly waiting on the filesystem, so go wider than -j */
+#define STATCACHE_PREFETCH_THREADS 16
+#define STATCACHE_PREFETCH_CHUNK 64
+
+/* The parts of struct stat we care about */
+struct FileStat {
+	bool exists;
+	struct timespec mtim;
+	uint64_t size;
+};
+
+/*
+ * Process-wide cache of file metadata, keyed by path. All of these are
+ * thread-safe. Anything that writes to a file must invalidate it.
+ */
+
+int
+statcache_get(const char *path, struct FileStat *fs);
+void
+statcache_invalidate(const char *path);
+void
+statcache_prefetch(const char **paths, size_t n);
+void
+statcache_clear(void);
+void
+statcache_counters(size_t *hits, size_t *misses);
+
+#endif
@@ -2,163 +2,207 @@
 #include <string.h>
 #include <stddef.h>
 
+#ifdef __SSE2__
+#	include <emmintrin.h>
+#endif
+
 #include "table.h"
 #include "util.h"
 
-// Linear probing, not very fast, and a random hash algorithm
+// Swiss-style open addressing: control bytes are scanned a group at a time,
+// and full hashes are cached so we only strcmp on a likely match
+
+#define H2(_hash) ((uint8_t)((_hash) >> 57))
 
-static uint32_t
-_djb2(const unsigned char *str)
+/* Bitmask of the slots in the group whose control byte is b */
+static inline uint32_t
+group_match(const uint8_t *ctrl, uint8_t b)
 {
-	uint32_t hash = 5381;
-	unsigned char c;
+#ifdef __SSE2__
+	__m128i group;
+	group = _mm_loadu_si128((const __m128i *)(const void *)ctrl);
+	return (uint32_t)_mm_movemask_epi8(
+		_mm_cmpeq_epi8(group, _mm_set1_epi8((char)b))
+	);
+#else
+	uint32_t mask = 0;
+	for (unsigned i = 0; i < TABLE_GROUP; i++)
+		mask |= (uint32_t)(ctrl[i] == b) << i;
+	return mask;
+#endif
+}
 
-	while ((c = *str++))
-		hash = ((hash << 5) + hash) + c;
+/* Bitmask of the slots in the group that are empty or deleted */
+static inline uint32_t
+group_match_free(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+	__m128i group;
+	group = _mm_loadu_si128((const __m128i *)(const void *)ctrl);
+	return (uint32_t)_mm_movemask_epi8(group);
+#else
+	uint32_t mask = 0;
+	for (unsigned i = 0; i < TABLE_GROUP; i++)
+		mask |= (uint32_t)(ctrl[i] >> 7) << i;
+	return mask;
+#endif
+}
 
-	return hash;
+uint64_t
+table_hash(const char *key)
+{
+	return hash64(key, strlen(key), 0);
 }
 
-void
-table_init(struct Table *tbl)
+static void
+table_alloc(struct Table *tbl, size_t n_slots)
 {
-	tbl->n_slots = TABLE_INIT_SLOTS;
+	tbl->n_slots = n_slots;
 	tbl->n_filled = 0;
 	tbl->n_tomb = 0;
-	tbl->slots = xcalloc(2 * TABLE_INIT_SLOTS, sizeof(*tbl->slots));
-	tbl->more = tbl->slots + tbl->n_slots;
+	tbl->ctrl = xmalloc(n_slots);
+	memset(tbl->ctrl, TABLE_CTRL_EMPTY, n_slots);
+	tbl->slots = xmalloc(n_slots * sizeof(*tbl->slots));
 }
 
 void
-table_destroy(struct Table *tbl)
+table_init(struct Table *tbl)
 {
-	for (size_t i = 0; i < tbl->n_slots; i++) {
-		if (!tbl->slots[i].key || tbl->slots[i].key == (char *)&tbl->n_tomb)
-			continue;
-		free(tbl->slots[i].key);
-	}
-	free(tbl->slots < tbl->more ? tbl->slots : tbl->more);
+	table_alloc(tbl, TABLE_INIT_SLOTS);
 }
 
 void
-table_resize(struct Table *tbl)
+table_destroy(struct Table *tbl)
 {
-	// Just double the capacity of the table
-
-	uint32_t slot;
-	const size_t old_cap = tbl->n_slots;
-	struct TableEntry *new_slots;
-
-	tbl->n_slots <<= 1;
-	new_slots = xcalloc(2 * tbl->n_slots, sizeof(*new_slots));
-
-	for (size_t i = 0; i < old_cap; i++) {
-		if (!tbl->slots[i].key || tbl->slots[i].key == (char *)&tbl->n_tomb)
+	free(tbl->ctrl);
+	free(tbl->slots);
+}
 
-			continue;
-		// Find new slot
-		slot = _djb2((unsigned char *)tbl->slots[i].key) &
-			(tbl->n_slots - 1); /* hash % n */
-		while (new_slots[slot].key)
-			slot = (slot + 1) & (tbl->n_slots - 1);
-		new_slots[slot].key = tbl->slots[i].key;
-		new_slots[slot].val = tbl->slots[i].val;
+/* Groups are visited in triangular order, which hits every one of them
+ * when there's a power of two of them */
+static size_t
+table_find_free(struct Table *tbl, uint64_t hash)
+{
+	size_t group, step;
+	size_t group_mask = tbl->n_slots / TABLE_GROUP - 1;
+	uint32_t match;
+
+	group = (size_t)hash & group_mask;
+	for (step = 1;; step++) {
+		match = group_match_free(tbl->ctrl + group * TABLE_GROUP);
+		if (match)
+			return group * TABLE_GROUP + (size_t)__builtin_ctz(match);
+		group = (group + step) & group_mask;
 	}
-	free(tbl->slots < tbl->more ? tbl->slots : tbl->more);
-	tbl->slots = new_slots;
-	tbl->more = tbl->slots + tbl->n_slots;
-	tbl->n_tomb = 0;
 }
 
 static void
-table_exhume(struct Table *tbl)
+table_rehash(struct Table *tbl, size_t n_slots)
 {
-	struct TableEntry *tmp;
+	struct Table new;
 	size_t slot;
 
-	memset(tbl->more, 0, tbl->n_slots * sizeof(*tbl->more));
-
+	table_alloc(&new, n_slots);
 	for (size_t i = 0; i < tbl->n_slots; i++) {
-		if (!tbl->slots[i].key || tbl->slots[i].key == (char *)&tbl->n_tomb)
+		if (tbl->ctrl[i] & TABLE_CTRL_EMPTY)
 			continue;
-		/* Find new slot */
-		slot = _djb2((unsigned char *)tbl->slots[i].key) &
-			(tbl->n_slots - 1); /* hash % n */
-		while (tbl->more[slot].key)
-			slot = (slot + 1) & (tbl->n_slots - 1);
-		tbl->more[slot].key = tbl->slots[i].key;
-		tbl->more[slot].val = tbl->slots[i].val;
+		slot = table_find_free(&new, tbl->slots[i].hash);
+		new.ctrl[slot] = tbl->ctrl[i];
+		new.slots[slot] = tbl->slots[i];
+		new.n_filled++;
 	}
-	tbl->n_tomb = 0;
+	table_destroy(tbl);
+	*tbl = new;
+}
 
-	tmp = tbl->more;
-	tbl->more = tbl->slots;
-	tbl->slots = tmp;
+void
+table_resize(struct Table *tbl)
+{
+	// Just double the capacity of the table
+	table_rehash(tbl, tbl->n_slots << 1);
 }
 
-static inline struct TableEntry *
-table_find_entry(struct Table *tbl, const char *key)
+/* Clear out tombstones without growing */
+static void
+table_exhume(struct Table *tbl)
 {
-	uint32_t slot;
+	table_rehash(tbl, tbl->n_slots);
+}
 
-	slot = _djb2((const unsigned char *)key) & (tbl->n_slots - 1);
-	while (tbl->slots[slot].key &&
-	       (tbl->slots[slot].key == (char *)&tbl->n_tomb ||
-	        strcmp(tbl->slots[slot].key, key))) {
-		slot = (slot + 1) & (tbl->n_slots - 1);
+static inline struct TableEntry *
+table_find_entry(struct Table *tbl, const char *key, uint64_t hash)
+{
+	size_t group, step, slot;
+	size_t group_mask = tbl->n_slots / TABLE_GROUP - 1;
+	const uint8_t *ctrl;
+	uint32_t match;
+
+	group = (size_t)hash & group_mask;
+	for (step = 1;; step++) {
+		ctrl = tbl->ctrl + group * TABLE_GROUP;
+		for (match = group_match(ctrl, H2(hash)); match; match &= match - 1) {
+			slot = group * TABLE_GROUP + (size_t)__builtin_ctz(match);
+			if (tbl->slots[slot].hash == hash &&
+			    !strcmp(tbl->slots[slot].key, key))
+				return tbl->slots + slot;
+		}
+		if (group_match(ctrl, TABLE_CTRL_EMPTY))
+			return NULL;
+		group = (group + step) & group_mask;
 	}
-	if (tbl->slots[slot].key)
-		return tbl->slots + slot;
-	else
-		return NULL;
 }
 
 void *
-table_insert(struct Table *tbl, const char *key, void *val)
+table_insert_hashed(
+	struct Table *tbl,
+	const char *key,
+	uint64_t hash,
+	void *val
+)
 {
-	uint32_t slot;
+	size_t slot;
 	struct TableEntry *ent;
 
 	/* If key already exists then update, else insert */
-	ent = table_find_entry(tbl, key);
+	ent = table_find_entry(tbl, key, hash);
 	if (ent) {
 		ent->val = val;
 		return ent->val;
-	} else {
-		if (100 * tbl->n_filled / tbl->n_slots > TABLE_RESIZE_RATIO)
-			table_resize(tbl);
-		if (100 * (tbl->n_filled + tbl->n_tomb) / tbl->n_slots >
-		    TABLE_RESIZE_RATIO)
-			table_exhume(tbl);
-
-		slot = _djb2((const unsigned char *)key) &
-			(tbl->n_slots - 1); /* hash % n */
-		while (tbl->slots[slot].key &&
-		       tbl->slots[slot].key != (char *)&tbl->n_tomb)
-			slot = (slot + 1) & (tbl->n_slots - 1);
-
-		if (tbl->slots[slot].key == (char *)&tbl->n_tomb)
-			tbl->n_tomb--;
-		tbl->slots[slot].key = xmalloc(strlen(key) + 1);
-		tbl->slots[slot].val = val;
-		strcpy(tbl->slots[slot].key, key);
-
-		tbl->n_filled++;
 	}
 
+	if (100 * (tbl->n_filled + 1) / tbl->n_slots > TABLE_RESIZE_RATIO)
+		table_resize(tbl);
+	else if (100 * (tbl->n_filled + tbl->n_tomb + 1) / tbl->n_slots >
+	         TABLE_RESIZE_RATIO)
+		table_exhume(tbl);
+
+	slot = table_find_free(tbl, hash);
+	if (tbl->ctrl[slot] == TABLE_CTRL_DELETED)
+		tbl->n_tomb--;
+	tbl->ctrl[slot] = H2(hash);
+	tbl->slots[slot].key = key;
+	tbl->slots[slot].hash = hash;
+	tbl->slots[slot].val = val;
+	tbl->n_filled++;
+
 	return tbl->slots[slot].val;
 }
 
+void *
+table_insert(struct Table *tbl, const char *key, void *val)
+{
+	return table_insert_hashed(tbl, key, table_hash(key), val);
+}
+
 int
 table_delete(struct Table *tbl, const char *key)
 {
 	struct TableEntry *addr;
 
-	addr = table_find_entry(tbl, key);
+	addr = table_find_entry(tbl, key, table_hash(key));
 	if (!addr)
 		return -1;
-	free(addr->key);
-	addr->key = (char *)&tbl->n_tomb;
+	tbl->ctrl[addr - tbl->slots] = TABLE_CTRL_DELETED;
 	tbl->n_filled--;
 	tbl->n_tomb++;
 
@@ -166,13 +210,19 @@ table_delete(struct Table *tbl, const char *key)
 }
 
 void **
-table_find(struct Table *tbl, const char *key)
+table_find_hashed(struct Table *tbl, const char *key, uint64_t hash)
 {
 	struct TableEntry *addr;
 
-	addr = table_find_entry(tbl, key);
+	addr = table_find_entry(tbl, key, hash);
 	if (!addr)
 		return NULL;
 	else
 		return &addr->val;
 }
+
+void **
+table_find(struct Table *tbl, const char *key)
+{
+	return table_find_hashed(tbl, key, table_hash(key));
+}
@@ -3,46 +3,67 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
+
+/* Slots are probed a group at a time by comparing their control bytes */
+#define TABLE_GROUP 16
 
 #ifndef TABLE_INIT_SLOTS
-#define TABLE_INIT_SLOTS 4
+#define TABLE_INIT_SLOTS 16
 #endif
 #ifndef TABLE_RESIZE_RATIO
-#define TABLE_RESIZE_RATIO 70
+#define TABLE_RESIZE_RATIO 87
 #endif
 
 static_assert(
 	(TABLE_INIT_SLOTS & (TABLE_INIT_SLOTS - 1)) == 0,
 	"TABLE_INIT_SLOTS must be a power of two"
 );
+static_assert(
+	TABLE_INIT_SLOTS >= TABLE_GROUP,
+	"TABLE_INIT_SLOTS must hold at least one group"
+);
 static_assert(
 	TABLE_RESIZE_RATIO > 0 && TABLE_RESIZE_RATIO < 100,
 	"TABLE_RESIZE_RATIO must be between 0% and 100%"
 );
 
 /*
- * We need there to be at least one free slot at all times, else there will be
- * infinite loops. So, n * ratio% < n - 1 should be satisfied so that the table
- * will always be resized before it completely fills up.
+ * We need there to be at least one empty slot at all times, else probing for
+ * a missing key never terminates. So, n * ratio% < n - 1 should be satisfied
+ * so that the table will always be resized before it completely fills up.
  */
 static_assert(
 	TABLE_INIT_SLOTS * TABLE_RESIZE_RATIO < (TABLE_INIT_SLOTS - 1) * 100,
 	"too few initial slots, or ratio is too large"
 );
 
+/*
+ * Control bytes: the high bit is set for empty and deleted slots, otherwise
+ * the low 7 bits are the top 7 bits of the key's hash, so most mismatches
+ * are ruled out 16 at a time without touching the slots.
+ */
+#define TABLE_CTRL_EMPTY 0x80
+#define TABLE_CTRL_DELETED 0xfe
+
+/* Keys are NOT copied, they must outlive their entry */
 struct TableEntry {
-	char *key;
+	const char *key;
+	uint64_t hash;
 	void *val;
 };
 
 struct Table {
-	size_t n_slots; /* 2^k */
+	size_t n_slots; /* 2^k, whole groups */
 	size_t n_filled;
-	size_t n_tomb; /* address of this field is tombstone */
+	size_t n_tomb;
+	uint8_t *ctrl;
 	struct TableEntry *slots;
-	struct TableEntry *more; /* unused half to avoid expensive copy */
 };
 
+uint64_t
+table_hash(const char *key);
+
 void
 table_init(struct Table *tbl);
 void
@@ -51,17 +72,26 @@ void
 table_resize(struct Table *tbl);
 void *
 table_insert(struct Table *tbl, const char *key, void *val);
+void *
+table_insert_hashed(
+	struct Table *tbl,
+	const char *key,
+	uint64_t hash,
+	void *val
+);
 int
 table_delete(struct Table *tbl, const char *key);
 void **
 table_find(struct Table *tbl, const char *key);
+void **
+table_find_hashed(struct Table *tbl, const char *key, uint64_t hash);
 
 #define TABLE_ITER(_tbl, _it)                    \
 	for (struct TableEntry *_it = (_tbl)->slots; \
 	     _it < (_tbl)->slots + (_tbl)->n_slots;  \
-	     it++)
-#define TABLE_ITER_SKIP_INVALID(_tbl, _it)              \
-	if (!it->key || it->key == (char *)&(_tbl)->n_tomb) \
+	     _it++)
+#define TABLE_ITER_SKIP_INVALID(_tbl, _it)                \
+	if ((_tbl)->ctrl[_it - (_tbl)->slots] & TABLE_CTRL_EMPTY) \
 		continue;
 
 #endif
@@ -1,6 +1,7 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "arena.h"
 #include "target.h"
 #include "util.h"
 
@@ -9,263 +10,352 @@ init_fragbase(struct FragBase *base, FragRenderer render_frag)
 {
 	base->buf = NULL;
 	base->render_frag = render_frag;
+	base->flags = 0;
 }
 
-#define FRAGTYPE_DEF(_frag_type)                                          \
-	static void FRAG_RENDERER_IMPL(_frag_type)(                           \
-		FRAG_T(_frag_type) * frag,                                        \
-		struct Rule * rule                                                \
-	);                                                                    \
-	static void FRAG_RENDERER(_frag_type)(                                \
-		struct FragBase * frag,                                           \
-		struct Rule * rule                                                \
-	)                                                                     \
-	{                                                                     \
-		FRAG_RENDERER_IMPL(_frag_type)((FRAG_T(_frag_type) *)frag, rule); \
+#define FRAGTYPE_DEF(_frag_type)                                    \
+	static void FRAG_RENDERER_IMPL(_frag_type)(                     \
+		FRAG_T(_frag_type) * frag,                                  \
+		struct Rule * rule,                                         \
+		struct Arena * arena                                        \
+	);                                                              \
+	static void FRAG_RENDERER(_frag_type)(                          \
+		struct FragBase * frag,                                     \
+		struct Rule * rule,                                         \
+		struct Arena * arena                                        \
+	)                                                               \
+	{                                                               \
+		FRAG_RENDERER_IMPL(_frag_type)(                             \
+			(FRAG_T(_frag_type) *)frag,                             \
+			rule,                                                   \
+			arena                                                   \
+		);                                                          \
 	}
 
 #define SUPER(_frag) ((struct FragBase *)_frag)
 
-#define SUPER_INIT(_frag, _frag_type)                           \
-	do {                                                        \
-		init_fragbase(&_frag->base, FRAG_RENDERER(_frag_type)); \
-		SUPER(_frag)->destructor = FRAG_DESTRUCTOR(_frag_type); \
-	} while (0)
+#define SUPER_INIT(_frag, _frag_type) \
+	init_fragbase(&_frag->base, FRAG_RENDERER(_frag_type))
 
 FRAGTYPE_DEF(target);
 
 FRAG_T(target) *
-FRAG_CONSTRUCTOR(target)(const char *name)
+FRAG_CONSTRUCTOR(target)(struct Interner *paths, const char *name)
 {
 	FRAG_T(target) *frag;
-	frag = xmalloc(sizeof(*frag));
+	frag = arena_alloc(paths->arena, sizeof(*frag));
 	SUPER_INIT(frag, target);
-	frag->name = str_fromraw(NULL, name);
+	frag->id = intern(paths, name);
+	frag->name = interned(paths, frag->id);
 	return frag;
 }
 
-Str
-FRAG_DESTRUCTOR(target)(struct FragBase *frag)
-{
-	Str ret = SUPER(frag)->buf;
-	str_free(((FRAG_T(target) *)frag)->name);
-	free(frag);
-	return ret;
-}
-
 static void
-FRAG_RENDERER_IMPL(target)(FRAG_T(target) *frag, struct Rule *rule)
+FRAG_RENDERER_IMPL(target)(
+	FRAG_T(target) *frag,
+	struct Rule *rule,
+	struct Arena *arena
+)
 {
-	frag->base.buf = str_dupl(frag->name);
+	frag->base.buf = frag->name;
 	(void)rule;
+	(void)arena;
 }
 
 FRAGTYPE_DEF(dep);
 
 FRAG_T(dep) *
-FRAG_CONSTRUCTOR(dep)(const char *name)
+FRAG_CONSTRUCTOR(dep)(struct Interner *paths, const char *name)
 {
 	FRAG_T(dep) *frag;
-	frag = xmalloc(sizeof(*frag));
+	frag = arena_alloc(paths->arena, sizeof(*frag));
 	SUPER_INIT(frag, dep);
-	frag->name = str_fromraw(NULL, name);
+	frag->id = intern(paths, name);
+	frag->name = interned(paths, frag->id);
 	return frag;
 }
 
-Str
-FRAG_DESTRUCTOR(dep)(struct FragBase *frag)
-{
-	Str ret = SUPER(frag)->buf;
-	str_free(((FRAG_T(dep) *)frag)->name);
-	free(frag);
-	return ret;
-}
-
 static void
-FRAG_RENDERER_IMPL(dep)(FRAG_T(dep) *frag, struct Rule *rule)
+FRAG_RENDERER_IMPL(dep)(
+	FRAG_T(dep) *frag,
+	struct Rule *rule,
+	struct Arena *arena
+)
 {
-	frag->base.buf = str_dupl(frag->name);
+	frag->base.buf = frag->name;
 	(void)rule;
+	(void)arena;
 }
 
 FRAGTYPE_DEF(lit);
 
 FRAG_T(lit) *
-FRAG_CONSTRUCTOR(lit)(const char *name)
+FRAG_CONSTRUCTOR(lit)(struct Arena *arena, const char *name)
 {
 	FRAG_T(lit) *frag;
-	frag = xmalloc(sizeof(*frag));
+	frag = arena_alloc(arena, sizeof(*frag));
 	SUPER_INIT(frag, lit);
-	frag->str = str_fromraw(NULL, name);
+	SUPER(frag)->flags = frag_split;
+	frag->str = name;
 	return frag;
 }
 
-Str
-FRAG_DESTRUCTOR(lit)(struct FragBase *frag)
-{
-	Str ret = SUPER(frag)->buf;
-	str_free(((FRAG_T(lit) *)frag)->str);
-	free(frag);
-	return ret;
-}
-
 static void
-FRAG_RENDERER_IMPL(lit)(FRAG_T(lit) *frag, struct Rule *rule)
+FRAG_RENDERER_IMPL(lit)(
+	FRAG_T(lit) *frag,
+	struct Rule *rule,
+	struct Arena *arena
+)
 {
-	SUPER(frag)->buf = str_dupl(frag->str);
+	SUPER(frag)->buf = frag->str;
 	(void)rule;
+	(void)arena;
 }
 
 FRAGTYPE_DEF(depidx);
 
 FRAG_T(depidx) *
-FRAG_CONSTRUCTOR(depidx)(size_t idx)
+FRAG_CONSTRUCTOR(depidx)(struct Arena *arena, size_t idx)
 {
 	FRAG_T(depidx) *frag;
-	frag = xmalloc(sizeof(*frag));
+	frag = arena_alloc(arena, sizeof(*frag));
 	SUPER_INIT(frag, depidx);
 	frag->idx = idx;
 	return frag;
 }
 
 static void
-FRAG_RENDERER_IMPL(depidx)(FRAG_T(depidx) *frag, struct Rule *rule)
+FRAG_RENDERER_IMPL(depidx)(
+	FRAG_T(depidx) *frag,
+	struct Rule *rule,
+	struct Arena *arena
+)
 {
 	if (frag->idx == 0)
-		SUPER(frag)->buf = str_dupl(((FRAG_T(dep) *)rule->targ)->base.buf);
+		SUPER(frag)->buf = SUPER(rule->targ)->buf;
 	else
-		SUPER(frag)->buf =
-			str_dupl(((FRAG_T(dep) *)rule->deps.data[frag->idx - 1])->base.buf);
-}
-
-Str
-FRAG_DESTRUCTOR(depidx)(struct FragBase *frag)
-{
-	Str ret = SUPER(frag)->buf;
-	free(frag);
-	return ret;
+		SUPER(frag)->buf = SUPER(rule->deps[frag->idx - 1])->buf;
+	(void)arena;
 }
 
 FRAGTYPE_DEF(alldeps);
 
 FRAG_T(alldeps) *
-FRAG_CONSTRUCTOR(alldeps)(void)
+FRAG_CONSTRUCTOR(alldeps)(struct Arena *arena)
 {
 	FRAG_T(alldeps) *frag;
-	frag = xmalloc(sizeof(*frag));
+	frag = arena_alloc(arena, sizeof(*frag));
 	SUPER_INIT(frag, alldeps);
+	SUPER(frag)->flags = frag_split;
 	return frag;
 }
 
-Str
-FRAG_DESTRUCTOR(alldeps)(struct FragBase *frag)
+static void
+FRAG_RENDERER_IMPL(alldeps)(
+	FRAG_T(alldeps) *frag,
+	struct Rule *rule,
+	struct Arena *arena
+)
+{
+	size_t len, n;
+	char *buf, *p;
+
+	len = 0;
+	for (size_t i = 0; i < rule->n_deps; i++)
+		len += strlen(SUPER(rule->deps[i])->buf) + 1;
+	p = buf = arena_alloc(arena, len + 1);
+	for (size_t i = 0; i < rule->n_deps; i++) {
+		n = strlen(SUPER(rule->deps[i])->buf);
+		memcpy(p, SUPER(rule->deps[i])->buf, n);
+		p[n] = ' ';
+		p += n + 1;
+	}
+	*p = '\0';
+	SUPER(frag)->buf = buf;
+}
+
+FRAGTYPE_DEF(shell);
+
+FRAG_T(shell) *
+FRAG_CONSTRUCTOR(shell)(struct Arena *arena)
 {
-	Str ret = SUPER(frag)->buf;
-	free(frag);
-	return ret;
+	FRAG_T(shell) *frag;
+	frag = arena_alloc(arena, sizeof(*frag));
+	SUPER_INIT(frag, shell);
+	SUPER(frag)->flags = frag_shell;
+	return frag;
 }
 
 static void
-FRAG_RENDERER_IMPL(alldeps)(FRAG_T(alldeps) *frag, struct Rule *rule)
+FRAG_RENDERER_IMPL(shell)(
+	FRAG_T(shell) *frag,
+	struct Rule *rule,
+	struct Arena *arena
+)
 {
-	SUPER(frag)->buf = str_alloc();
-	for (void **dep = rule->deps.data; dep < rule->deps.data + rule->deps.len;
-	     dep++)
-		SUPER(frag)->buf = str_merge(
-			SUPER(frag)->buf,
-			str_concatraw(str_dupl(SUPER(*dep)->buf), " ")
-		);
+	SUPER(frag)->buf = "";
+	(void)rule;
+	(void)arena;
 }
 
 struct Rule *
 make_rule(
+	struct Arena *arena,
 	FRAG_T(target) *targ,
-	struct Array *deps,
+	struct DepList *deps,
 	struct FragBase **frags,
 	size_t n_frags
 )
 {
 	struct Rule *rule;
 
-	rule = xmalloc(sizeof(*rule));
-	array_init(&rule->deps);
-	array_init(&rule->frags);
+	rule = arena_alloc(arena, sizeof(*rule));
 	rule->targ = targ;
-	if (deps) {
-		for (void **dep = deps->data; dep < deps->data + deps->len; dep++)
-			array_push(&rule->deps, *dep);
-		array_destroy(deps);
-		free(deps);
+	rule->n_deps = deps ? deps->len : 0;
+	rule->deps = deps ? deps->data : NULL;
+	rule->n_frags = n_frags;
+	rule->frags = NULL;
+	if (n_frags) { /* frags is usually a compound literal on the stack */
+		rule->frags = arena_alloc(arena, n_frags * sizeof(*rule->frags));
+		memcpy(rule->frags, frags, n_frags * sizeof(*rule->frags));
 	}
-	if (frags)
-		for (struct FragBase **cmd = frags; cmd < frags + n_frags; cmd++)
-			array_push(&rule->frags, *cmd);
 
 	return rule;
 }
 
 /* Renders all fragments, and constructs the command */
 Str
-render_rule(struct Rule *rule)
+render_rule(struct Rule *rule, struct Arena *arena)
 {
 	Str buf;
-	buf = str_alloc();
-
-	SUPER(rule->targ)->render_frag(SUPER(rule->targ), rule);
-	for (void **dep = rule->deps.data; dep < rule->deps.data + rule->deps.len;
-	     dep++)
-		SUPER(*dep)->render_frag(SUPER(*dep), rule);
-	for (void **frag = rule->frags.data;
-	     frag < rule->frags.data + rule->frags.len;
-	     frag++)
-		SUPER(*frag)->render_frag(SUPER(*frag), rule);
-
-	for (void **cmd = rule->frags.data;
-	     cmd < rule->frags.data + rule->frags.len;
-	     cmd++)
-		buf = str_concat(buf, SUPER(*cmd)->buf);
+	size_t len, n;
+	char *p;
+
+	SUPER(rule->targ)->render_frag(SUPER(rule->targ), rule, arena);
+	for (size_t i = 0; i < rule->n_deps; i++)
+		SUPER(rule->deps[i])->render_frag(SUPER(rule->deps[i]), rule, arena);
+	for (size_t i = 0; i < rule->n_frags; i++)
+		rule->frags[i]->render_frag(rule->frags[i], rule, arena);
+
+	len = 0;
+	for (size_t i = 0; i < rule->n_frags; i++)
+		len += strlen(rule->frags[i]->buf);
+	p = buf = str_arena(arena, len);
+	for (size_t i = 0; i < rule->n_frags; i++) {
+		n = strlen(rule->frags[i]->buf);
+		memcpy(p, rule->frags[i]->buf, n);
+		p += n;
+	}
 	return buf;
 }
 
-/* Besides just constructing the target it also quasi-destructs
- * the entire rule and all its constituent objects. This is probably
- * the worst way I could've possibly done this. */
+/* What the shell would have made something of, but exec takes literally */
+#define SHELL_META "'\"`\\$;&|<>()*?["
+
+/* Splits the rendered fragments into an argv, so the command can be
+ * exec'd directly. Lits and alldeps are split on whitespace (there is no
+ * quoting), everything else is glued onto the word it's next to. Returns
+ * NULL instead if some fragment asked for a shell, and dies if one that's
+ * split looks like it wanted one. Call after render_rule. */
+char **
+render_argv(struct Rule *rule, struct Arena *arena)
+{
+	struct Array words;
+	Str word;
+	bool in_word;
+	char **argv;
+
+	for (size_t i = 0; i < rule->n_frags; i++)
+		if (rule->frags[i]->flags & frag_shell)
+			return NULL;
+
+	array_init(&words);
+	word = str_alloc();
+	in_word = false;
+	for (size_t i = 0; i < rule->n_frags; i++) {
+		const char *p = rule->frags[i]->buf;
+		size_t n;
+
+		if (!(rule->frags[i]->flags & frag_split)) {
+			word = str_concatraw(word, p);
+			in_word |= *p != '\0';
+			continue;
+		}
+		if (strpbrk(p, SHELL_META))
+			die(
+				"%s: `%s` needs a shell, but commands are exec'd directly "
+				"unless they include shell()",
+				rule->targ->name,
+				p
+			);
+		while (*p) {
+			n = strcspn(p, " \t\n");
+			if (n) {
+				word = str_concatlen(word, p, n);
+				in_word = true;
+				p += n;
+			}
+			n = strspn(p, " \t\n");
+			if (n && in_word) {
+				array_push(&words, arena_strdup(arena, word));
+				word = str_fromraw(word, "");
+				in_word = false;
+			}
+			p += n;
+		}
+	}
+	if (in_word)
+		array_push(&words, arena_strdup(arena, word));
+	str_free(word);
+
+	argv = arena_alloc(arena, (words.len + 1) * sizeof(*argv));
+	memcpy(argv, words.data, words.len * sizeof(*argv));
+	argv[words.len] = NULL;
+	array_destroy(&words);
+	return argv;
+}
+
+/* The fragments already hold interned names; the dependencies' ids are
+ * appended to dep_ids. The command isn't rendered until target_render. */
 struct Target *
-target_from_rule(struct Rule *rule)
+target_from_rule(
+	struct Arena *arena,
+	struct Rule *rule,
+	struct IdArray *dep_ids
+)
 {
 	struct Target *targ;
 
-	targ = xmalloc(sizeof(*targ));
-	targ->cmd = render_rule(rule);
-	targ->name = SUPER(rule->targ)->destructor(SUPER(rule->targ));
+	targ = arena_alloc(arena, sizeof(*targ));
+	targ->rule = rule;
+	targ->cmd = NULL;
+	targ->argv = NULL;
+	targ->shell = false;
+	targ->id = rule->targ->id;
+	targ->name = rule->targ->name;
 	targ->visited = false;
+	targ->done = false;
+	targ->prio = 0;
+	targ->duration_ns = 0;
 	atomic_init(&targ->n_sat_dep, 0);
-	array_init(&targ->codeps);
-	array_init(&targ->deps);
-	for (size_t i = 0; i < rule->deps.len; i++) {
-		FRAG_T(dep) *dep = rule->deps.data[i];
-		array_push(&targ->deps, SUPER(dep)->destructor(SUPER(dep)));
-	}
-
-	for (size_t i = 0; i < rule->frags.len; i++) {
-		struct FragBase *frag = rule->frags.data[i];
-		str_free(frag->destructor(frag));
-	}
-	array_destroy(&rule->deps);
-	array_destroy(&rule->frags);
-	free(rule);
+	targ->codeps.off = 0;
+	targ->codeps.len = 0;
+	targ->deps.off = (uint32_t)dep_ids->len;
+	targ->deps.len = (uint32_t)rule->n_deps;
+	for (size_t i = 0; i < rule->n_deps; i++)
+		idarray_push(dep_ids, rule->deps[i]->id);
 
 	return targ;
 }
 
+/* Builds the command, if it hasn't been already */
 void
-target_destroy(struct Target *targ)
+target_render(struct Target *targ, struct Arena *arena)
 {
-	str_free(targ->name);
-	str_free(targ->cmd);
-	for (size_t i = 0; i < targ->deps.len; i++)
-		str_free(targ->deps.data[i]);
-	array_destroy(&targ->deps);
-	array_destroy(&targ->codeps);
-	free(targ);
+	if (targ->cmd)
+		return;
+	targ->cmd = render_rule(targ->rule, arena);
+	targ->argv = render_argv(targ->rule, arena);
+	targ->shell = !targ->argv;
+	targ->rule = NULL;
 }
@@ -1,72 +1,124 @@
 #ifndef INCLUDE_TARGET_H
 #define INCLUDE_TARGET_H
 
+#include "arena.h"
+#include "intern.h"
 #include "simpleds.h"
 #include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #define FRAG_T(_frag_type) struct Frag_##_frag_type
 #define FRAG_RENDERER_IMPL(_frag_type) render_frag_##_frag_type
 #define FRAG_RENDERER(_frag_type) render_frag_##_frag_type##_
 #define FRAG_CONSTRUCTOR(_frag_type) make_frag_##_frag_type##_
-#define FRAG_DESTRUCTOR(_frag_type) destroy_frag_##_frag_type##_
 
-#define FRAGTYPE_DECL(_frag_type, _frag_fields, _frag_init_args)        \
-	struct Frag_##_frag_type {                                          \
-		struct FragBase base;                                           \
-		_frag_fields                                                    \
-	};                                                                  \
-	FRAG_T(_frag_type) * FRAG_CONSTRUCTOR(_frag_type)(_frag_init_args); \
-	Str FRAG_DESTRUCTOR(_frag_type)(struct FragBase * frag); /* cursed */
+/* Fragments live in the graph's arena, so there's nothing to destroy */
+#define FRAGTYPE_DECL(_frag_type, _frag_fields, ...)                \
+	struct Frag_##_frag_type {                                      \
+		struct FragBase base;                                       \
+		_frag_fields                                                \
+	};                                                              \
+	FRAG_T(_frag_type) * FRAG_CONSTRUCTOR(_frag_type)(__VA_ARGS__);
 
 struct Rule {
-	FRAG_T(target) *targ; /* TargetFrag */
-	struct Array deps;  /* DepFrag */
-	struct Array frags; /* FragBase */
+	FRAG_T(target) *targ;   /* TargetFrag */
+	FRAG_T(dep) **deps;     /* DepFrag */
+	size_t n_deps;
+	struct FragBase **frags;
+	size_t n_frags;
+};
+
+/* What needs(...) hands to make_rule */
+struct DepList {
+	size_t len;
+	FRAG_T(dep) *data[];
+};
+
+/* A target's slice of a CSR edge list (struct IdArray of target ids) */
+struct Edges {
+	uint32_t off;
+	uint32_t len;
 };
 
 struct Target {
-	Str name;
-	Str cmd;
-	struct Array deps;
-	struct Array codeps; /* NOTE: array of struct Target * */
+	uint32_t id;
+	const char *name;  /* interned, owned by the graph */
+	struct Rule *rule; /* dropped once rendered */
+	Str cmd;           /* NULL until rendered */
+	char **argv;       /* NULL-terminated, NULL if shell is set */
+	bool shell;        /* run cmd through /bin/sh instead */
+	struct Edges deps;   /* into the graph's dep_ids */
+	struct Edges codeps; /* into the graph's codep_ids */
 	atomic_size_t n_sat_dep;
+	uint64_t prio;        /* expected ns until the final target, via us */
+	uint64_t duration_ns; /* how long our job took this run, 0 if not run */
 	char visited;
+	char done; /* up to date as of the last run that reached us */
+};
+
+enum FragFlags {
+	frag_split = 1 << 0, /* buf is split into argv words on whitespace */
+	frag_shell = 1 << 1, /* the command needs a shell */
 };
 
 struct FragBase {
-	void (*render_frag)(struct FragBase *, struct Rule *);
-	Str (*destructor)(struct FragBase *frag);
-	Str buf; /* WARNING: DO NOT FREE! */
+	void (*render_frag)(struct FragBase *, struct Rule *, struct Arena *);
+	const char *buf; /* may be shared with other fragments */
+	unsigned flags;
 };
 
-typedef void (*FragRenderer)(struct FragBase *, struct Rule *);
+typedef void (*FragRenderer)(struct FragBase *, struct Rule *, struct Arena *);
+
+/* Target and dep names are interned on construction, and lits aren't copied
+ * at all (the DSL only ever hands us string literals) */
+FRAGTYPE_DECL(
+	target,
+	const char *name;
+	uint32_t id;,
+	struct Interner *paths,
+	const char *name
+)
 
-FRAGTYPE_DECL(target, char *name;, const char *name)
+FRAGTYPE_DECL(
+	dep,
+	const char *name;
+	uint32_t id;,
+	struct Interner *paths,
+	const char *name
+)
 
-FRAGTYPE_DECL(dep, char *name;, const char *name)
+FRAGTYPE_DECL(lit, const char *str;, struct Arena *arena, const char *str)
 
-FRAGTYPE_DECL(lit, char *str;, const char *str)
+FRAGTYPE_DECL(depidx, size_t idx;, struct Arena *arena, size_t idx)
 
-FRAGTYPE_DECL(depidx, size_t idx;, size_t idx)
+FRAGTYPE_DECL(alldeps, , struct Arena *arena)
 
-FRAGTYPE_DECL(alldeps, , void)
+FRAGTYPE_DECL(shell, , struct Arena *arena)
 
 struct Rule *
 make_rule(
+	struct Arena *arena,
 	FRAG_T(target) *targ,
-	struct Array *deps,
+	struct DepList *deps,
 	struct FragBase **frags,
 	size_t n_frags
 );
 
 Str
-render_rule(struct Rule *rule);
+render_rule(struct Rule *rule, struct Arena *arena);
+
+char **
+render_argv(struct Rule *rule, struct Arena *arena);
 
-/* WARNING: destroys the rule */
 struct Target *
-target_from_rule(struct Rule *rule);
+target_from_rule(
+	struct Arena *arena,
+	struct Rule *rule,
+	struct IdArray *dep_ids
+);
 
 void
-target_destroy(struct Target *targ);
+target_render(struct Target *targ, struct Arena *arena);
 
 #endif
@@ -3,73 +3,54 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "simpleds.h"
 #include "threadpool.h"
 #include "util.h"
 
-struct ThreadPoolWorker {
-	/* Thread info */
-	pthread_t tid;
-	pthread_mutex_t *idle_list_mut;
-	pthread_cond_t *idle_list_cond;
-	pthread_mutex_t *start_mut;
-	pthread_cond_t *start_cond;
-	bool start;
-
-	/* Argument passing */
+struct ThreadPoolJob {
 	WorkerCb fn;
-	size_t arg_size;
-	void *args;
-	char static_args[STATIC_ARG_MAX];
+	char args[]; /* pool->arg_size bytes */
+};
 
-	/* List */
-	struct ThreadPoolWorker **head;
-	struct ThreadPoolWorker *next;
+struct ThreadPoolWorker {
+	pthread_t tid;
+	struct ThreadPool *pool;
+	int id;
 };
 
+static _Thread_local int worker_id = -1;
+
 static void *
 worker_stub(void *_self)
 {
 	struct ThreadPoolWorker *self = _self;
+	struct ThreadPool *pool = self->pool;
+	struct ThreadPoolJob *job;
 
-	self->start = false;
-	self->start_mut = xmalloc(sizeof(*self->start_mut));
-	self->start_cond = xmalloc(sizeof(*self->start_cond));
-	pthread_mutex_init(self->start_mut, NULL);
-	pthread_cond_init(self->start_cond, NULL);
-	if (self->arg_size > STATIC_ARG_MAX)
-		self->args = xmalloc(self->arg_size);
-	else
-		self->args = self->static_args;
+	worker_id = self->id;
 
+	pthread_mutex_lock(&pool->mut);
 	for (;;) {
-		pthread_mutex_lock(self->start_mut);
-
-		pthread_mutex_lock(self->idle_list_mut);
-		self->next = *self->head;
-		*self->head = self;
-		pthread_cond_signal(self->idle_list_cond);
-		pthread_mutex_unlock(self->idle_list_mut);
-		while (!self->start)
-			pthread_cond_wait(self->start_cond, self->start_mut);
-		self->start = false;
-		pthread_mutex_unlock(self->start_mut);
-
-		self->fn(self->args);
+		while (!heap_len(&pool->jobs) && !pool->stop)
+			pthread_cond_wait(&pool->work_cond, &pool->mut);
+		if (!heap_len(&pool->jobs))
+			break; /* stopping, and nothing left to do */
+
+		job = heap_pop(&pool->jobs);
+		pool->n_active++;
+		pthread_mutex_unlock(&pool->mut);
+
+		job->fn(job->args);
+		free(job);
+
+		pthread_mutex_lock(&pool->mut);
+		pool->n_active--;
+		if (!pool->n_active && !heap_len(&pool->jobs))
+			pthread_cond_broadcast(&pool->idle_cond);
 	}
-}
+	pthread_mutex_unlock(&pool->mut);
 
-static void
-worker_term(void *_self)
-{
-	struct ThreadPoolWorker *self = *(struct ThreadPoolWorker **)_self;
-
-	pthread_mutex_destroy(self->start_mut);
-	pthread_cond_destroy(self->start_cond);
-	free(self->start_mut);
-	free(self->start_cond);
-	if (self->args != self->static_args)
-		free(self->args);
-	pthread_exit(0);
+	return NULL;
 }
 
 int
@@ -80,19 +61,18 @@ threadpool_init(
 )
 {
 	pool->max_workers = max_workers;
-	pool->idle_list_mut = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
-	pool->idle_list_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
-
-	pool->workers = xmalloc(max_workers * sizeof(*pool->idle_workers));
-	pool->idle_workers = NULL;
-	for (unsigned i = 0; i < max_workers; i++) {
-		pool->workers[i].arg_size = arg_size;
-
-		pool->workers[i].head = &pool->idle_workers;
-		pool->workers[i].next = NULL;
-		pool->workers[i].idle_list_mut = &pool->idle_list_mut;
-		pool->workers[i].idle_list_cond = &pool->idle_list_cond;
-
+	pool->arg_size = arg_size;
+	pool->n_active = 0;
+	pool->stop = false;
+	pthread_mutex_init(&pool->mut, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->idle_cond, NULL);
+	heap_init(&pool->jobs);
+
+	pool->workers = xmalloc(max_workers * sizeof(*pool->workers));
+	for (size_t i = 0; i < max_workers; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = (int)i;
 		if (pthread_create(
 				&pool->workers[i].tid,
 				NULL,
@@ -105,38 +85,65 @@ threadpool_init(
 	return 0;
 }
 
+/* Queue up a job; higher priorities are picked up first. Safe to call from
+ * inside a job. */
+void
+threadpool_submit(
+	struct ThreadPool *pool,
+	WorkerCb fn,
+	void *args,
+	uint64_t prio
+)
+{
+	struct ThreadPoolJob *job;
+
+	job = xmalloc(sizeof(*job) + pool->arg_size);
+	job->fn = fn;
+	if (pool->arg_size)
+		memcpy(job->args, args, pool->arg_size);
+
+	pthread_mutex_lock(&pool->mut);
+	heap_push(&pool->jobs, prio, job);
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mut);
+}
+
 void
 threadpool_execute(struct ThreadPool *pool, WorkerCb fn, void *args)
 {
-	struct ThreadPoolWorker *worker;
-
-	pthread_mutex_lock(&pool->idle_list_mut);
-	while (pool->idle_workers == NULL)
-		pthread_cond_wait(&pool->idle_list_cond, &pool->idle_list_mut);
-	worker = pool->idle_workers;
-	pool->idle_workers = pool->idle_workers->next;
-	pthread_mutex_unlock(&pool->idle_list_mut);
-
-	pthread_mutex_lock(worker->start_mut);
-	worker->fn = fn;
-	if (fn == &worker_term) /* HACK */
-		memcpy(worker->args, &worker, sizeof(worker));
-	else
-		memcpy(worker->args, args, worker->arg_size);
-	worker->start = true;
-	pthread_cond_signal(worker->start_cond);
-	pthread_mutex_unlock(worker->start_mut);
+	threadpool_submit(pool, fn, args, 0);
+}
+
+/* Block until no jobs are queued or running */
+void
+threadpool_wait(struct ThreadPool *pool)
+{
+	pthread_mutex_lock(&pool->mut);
+	while (pool->n_active || heap_len(&pool->jobs))
+		pthread_cond_wait(&pool->idle_cond, &pool->mut);
+	pthread_mutex_unlock(&pool->mut);
 }
 
 void
 threadpool_destroy(struct ThreadPool *pool)
 {
-	for (unsigned i = 0; i < pool->max_workers; i++)
-		threadpool_execute(pool, &worker_term, NULL);
-	for (unsigned i = 0; i < pool->max_workers; i++)
+	pthread_mutex_lock(&pool->mut);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mut);
+	for (size_t i = 0; i < pool->max_workers; i++)
 		pthread_join(pool->workers[i].tid, NULL);
 
-	pthread_mutex_destroy(&pool->idle_list_mut);
-	pthread_cond_destroy(&pool->idle_list_cond);
+	heap_destroy(&pool->jobs);
+	pthread_mutex_destroy(&pool->mut);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->idle_cond);
 	free(pool->workers);
 }
+
+/* Index of the calling worker within its pool, or -1 outside of one */
+int
+threadpool_worker_id(void)
+{
+	return worker_id;
+}
@@ -1,24 +1,26 @@
 #ifndef INCLUDE_THREADPOOL_H
 #define INCLUDE_THREADPOOL_H
 
-#include <assert.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-#define STATIC_ARG_MAX (4 * sizeof(void *))
-
-static_assert(
-	STATIC_ARG_MAX >= sizeof(void *),
-	"STATIC_ARG_MAX must be large enough to hold a void pointer"
-);
+#include "simpleds.h"
 
 typedef void (*WorkerCb)(void *);
 
+/* Workers sleep on a shared priority queue of jobs; jobs may submit more
+ * jobs from inside the pool, so nobody has to sit around handing them out. */
 struct ThreadPool {
 	size_t max_workers;
-	pthread_mutex_t idle_list_mut;
-	pthread_cond_t idle_list_cond;
-	struct ThreadPoolWorker *idle_workers, *workers;
+	size_t arg_size;
+	size_t n_active; /* jobs currently being run */
+	bool stop;
+	pthread_mutex_t mut;
+	pthread_cond_t work_cond; /* signalled when a job is queued */
+	pthread_cond_t idle_cond; /* signalled when the pool drains */
+	struct Heap jobs;
+	struct ThreadPoolWorker *workers;
 };
 
 int
@@ -30,6 +32,17 @@ threadpool_init(
 void
 threadpool_execute(struct ThreadPool *pool, WorkerCb fn, void *args);
 void
+threadpool_submit(
+	struct ThreadPool *pool,
+	WorkerCb fn,
+	void *args,
+	uint64_t prio
+);
+void
+threadpool_wait(struct ThreadPool *pool);
+void
 threadpool_destroy(struct ThreadPool *pool);
+int
+threadpool_worker_id(void);
 
 #endif
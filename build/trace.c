@@ -0,0 +1,131 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "simpleds.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "util.h"
+
+static uint64_t
+monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* A NULL path leaves tracing off, and everything else a no-op */
+void
+trace_init(struct Trace *trace, const char *path)
+{
+	trace->enabled = path && *path;
+	trace->path = path;
+	trace->epoch_ns = monotonic_ns();
+	pthread_mutex_init(&trace->mut, NULL);
+	array_init(&trace->events);
+}
+
+/* Microseconds since the trace started */
+uint64_t
+trace_now(struct Trace *trace)
+{
+	return (monotonic_ns() - trace->epoch_ns) / 1000;
+}
+
+/* Record a job that started at start_us and finished just now, on the
+ * calling worker */
+void
+trace_job(
+	struct Trace *trace,
+	const char *name,
+	uint64_t start_us,
+	bool ran
+)
+{
+	struct TraceEvent *ev;
+
+	if (!trace->enabled)
+		return;
+	ev = xmalloc(sizeof(*ev));
+	ev->name = name;
+	ev->start_us = start_us;
+	ev->end_us = trace_now(trace);
+	ev->tid = threadpool_worker_id();
+	ev->ran = ran;
+
+	pthread_mutex_lock(&trace->mut);
+	array_push(&trace->events, ev);
+	pthread_mutex_unlock(&trace->mut);
+}
+
+static void
+json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+int
+trace_write(struct Trace *trace)
+{
+	FILE *fp;
+	int max_tid;
+
+	if (!trace->enabled)
+		return 0;
+	fp = fopen(trace->path, "w");
+	if (!fp)
+		return -1;
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", fp);
+	max_tid = -1;
+	for (size_t i = 0; i < trace->events.len; i++) {
+		struct TraceEvent *ev = trace->events.data[i];
+		fputs("{\"name\":", fp);
+		json_string(fp, ev->name);
+		fprintf(
+			fp,
+			",\"cat\":\"job\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+			"\"ts\":%llu,\"dur\":%llu,\"args\":{\"up_to_date\":%s}},\n",
+			ev->tid,
+			(unsigned long long)ev->start_us,
+			(unsigned long long)(ev->end_us - ev->start_us),
+			ev->ran ? "false" : "true"
+		);
+		if (ev->tid > max_tid)
+			max_tid = ev->tid;
+	}
+	for (int tid = 0; tid <= max_tid; tid++)
+		fprintf(
+			fp,
+			"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+			"\"args\":{\"name\":\"worker %d\"}},\n",
+			tid,
+			tid
+		);
+	fputs(
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"args\":{\"name\":\"construct\"}}\n]}\n",
+		fp
+	);
+
+	return ferror(fp) | fclose(fp) ? -1 : 0;
+}
+
+void
+trace_destroy(struct Trace *trace)
+{
+	for (size_t i = 0; i < trace->events.len; i++)
+		free(trace->events.data[i]);
+	array_destroy(&trace->events);
+	pthread_mutex_destroy(&trace->mut);
+}
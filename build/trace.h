@@ -0,0 +1,46 @@
+#ifndef INCLUDE_TRACE_H
+#define INCLUDE_TRACE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "simpleds.h"
+
+/* Set to a path to get a Chrome trace_event JSON of the build, which can be
+ * opened in Perfetto or chrome://tracing */
+#define TRACE_ENV "CONSTRUCT_TRACE"
+
+struct TraceEvent {
+	const char *name; /* must outlive the trace */
+	uint64_t start_us;
+	uint64_t end_us;
+	int tid;
+	bool ran; /* false if the target was up to date */
+};
+
+struct Trace {
+	bool enabled;
+	const char *path;
+	uint64_t epoch_ns;
+	pthread_mutex_t mut;
+	struct Array events; /* struct TraceEvent * */
+};
+
+void
+trace_init(struct Trace *trace, const char *path);
+uint64_t
+trace_now(struct Trace *trace);
+void
+trace_job(
+	struct Trace *trace,
+	const char *name,
+	uint64_t start_us,
+	bool ran
+);
+int
+trace_write(struct Trace *trace);
+void
+trace_destroy(struct Trace *trace);
+
+#endif
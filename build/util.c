@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -43,3 +44,50 @@ xstrdup(const char *s)
 		abort();
 	return ns;
 }
+
+/* MurmurHash64A; not cryptographic, but fast and well-distributed, which is
+ * all we need to notice that a file or command changed. */
+uint64_t
+hash64(const void *buf, size_t len, uint64_t seed)
+{
+	const uint64_t m = 0xc6a4a7935bd1e995ull;
+	const int r = 47;
+	const unsigned char *p = buf;
+	const unsigned char *end = p + (len & ~(size_t)7);
+	uint64_t h = seed ^ (len * m);
+	uint64_t k;
+
+	for (; p < end; p += 8) {
+		memcpy(&k, p, sizeof(k));
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+		h ^= k;
+		h *= m;
+	}
+
+	k = 0;
+	switch (len & 7) {
+	case 7:
+		k ^= (uint64_t)p[6] << 48; /* fallthrough */
+	case 6:
+		k ^= (uint64_t)p[5] << 40; /* fallthrough */
+	case 5:
+		k ^= (uint64_t)p[4] << 32; /* fallthrough */
+	case 4:
+		k ^= (uint64_t)p[3] << 24; /* fallthrough */
+	case 3:
+		k ^= (uint64_t)p[2] << 16; /* fallthrough */
+	case 2:
+		k ^= (uint64_t)p[1] << 8; /* fallthrough */
+	case 1:
+		k ^= (uint64_t)p[0];
+		h ^= k;
+		h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+	return h;
+}
@@ -2,6 +2,7 @@
 #define INCLUDE_UTIL_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -14,6 +15,17 @@ xrealloc(void *p, size_t n);
 char *
 xstrdup(const char *s);
 
+uint64_t
+hash64(const void *buf, size_t len, uint64_t seed);
+
+#ifdef __APPLE__ // piece of shit
+#	define ST_MTIM(_sb) ((_sb).st_mtimespec)
+#	define ST_ATIM(_sb) ((_sb).st_atimespec)
+#else
+#	define ST_MTIM(_sb) ((_sb).st_mtim)
+#	define ST_ATIM(_sb) ((_sb).st_atim)
+#endif
+
 /* Logging */
 
 /* ANSI escapes */
@@ -0,0 +1,209 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#	include <sys/inotify.h>
+#endif
+
+#include "simpleds.h"
+#include "table.h"
+#include "target.h"
+#include "util.h"
+#include "watch.h"
+
+#ifdef __linux__
+
+#define WATCH_MASK \
+	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+/* The directory part of path, as a prefix: "a/b.c" -> "a", "b.c" -> "" */
+static char *
+dir_prefix(const char *path)
+{
+	const char *slash;
+	char *dir;
+	size_t n;
+
+	slash = strrchr(path, '/');
+	n = slash ? (size_t)(slash - path) : 0;
+	dir = xmalloc(n + 1);
+	memcpy(dir, path, n);
+	dir[n] = '\0';
+	return dir;
+}
+
+int
+watch_init(struct Watch *w, struct Array *sources)
+{
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd == -1)
+		return -1;
+	array_init(&w->dirs);
+	table_init(&w->files);
+
+	for (size_t i = 0; i < sources->len; i++) {
+		struct Target *src = sources->data[i];
+		char *dir;
+		int wd;
+
+		dir = dir_prefix(src->name);
+		wd = inotify_add_watch(w->fd, *dir ? dir : ".", WATCH_MASK);
+		if (wd == -1) {
+			log(
+				msgt_warn,
+				"watch: can't watch %s: %s",
+				src->name,
+				strerror(errno)
+			);
+			free(dir);
+			continue;
+		}
+		while (w->dirs.len <= (size_t)wd)
+			array_push(&w->dirs, NULL);
+		if (w->dirs.data[wd])
+			free(dir); /* already watching it */
+		else
+			w->dirs.data[wd] = dir;
+		table_insert(&w->files, src->name, src);
+	}
+	return 0;
+}
+
+static void
+watch_changed(struct Table *seen, struct Array *changed, struct Target *src)
+{
+	if (table_find(seen, src->name))
+		return;
+	table_insert(seen, src->name, src);
+	array_push(changed, src);
+}
+
+/* Queues up the source an event is about, if it's one of ours and we
+ * haven't already. If the kernel's queue overflowed, we can't know what we
+ * missed, so it could have been any of them. */
+static void
+watch_event(
+	struct Watch *w,
+	const struct inotify_event *ev,
+	struct Table *seen,
+	struct Array *changed,
+	Str *path
+)
+{
+	const char *dir;
+	void **src;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		log(msgt_warn, "watch: missed some events, rechecking everything", 0);
+		TABLE_ITER(&w->files, it) {
+			TABLE_ITER_SKIP_INVALID(&w->files, it);
+			watch_changed(seen, changed, it->val);
+		}
+		return;
+	}
+	if (!ev->len || ev->wd < 0 || (size_t)ev->wd >= w->dirs.len)
+		return;
+	dir = w->dirs.data[ev->wd];
+	if (!dir)
+		return;
+
+	*path = str_fromraw(*path, dir);
+	if (**path)
+		*path = str_concatraw(*path, "/");
+	*path = str_concatraw(*path, ev->name);
+
+	src = table_find(&w->files, *path);
+	if (src)
+		watch_changed(seen, changed, *src);
+}
+
+/* Blocks until some sources change, then keeps collecting until things go
+ * quiet for WATCH_DEBOUNCE_MS, so a burst of events makes one batch. Events
+ * that come in while the caller is busy building just queue up in the
+ * kernel until the next call. Returns -1 if interrupted by a signal. */
+int
+watch_wait(struct Watch *w, struct Array *changed)
+{
+	_Alignas(struct inotify_event) char buf[4096];
+	struct pollfd pfd;
+	struct Table seen;
+	Str path;
+	ssize_t n;
+	int timeout, ret;
+
+	pfd.fd = w->fd;
+	pfd.events = POLLIN;
+	table_init(&seen);
+	path = str_alloc();
+	ret = 0;
+
+	timeout = -1;
+	for (;;) {
+		ret = poll(&pfd, 1, timeout);
+		if (ret == -1) {
+			if (errno == EINTR)
+				break;
+			die("watch: poll failed: %s", strerror(errno));
+		}
+		if (ret == 0) {
+			if (changed->len)
+				break; /* it went quiet */
+			timeout = -1;
+			continue;
+		}
+
+		while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+			for (char *p = buf; p < buf + n;) {
+				const struct inotify_event *ev;
+				ev = (const struct inotify_event *)(const void *)p;
+				watch_event(w, ev, &seen, changed, &path);
+				p += sizeof(*ev) + ev->len;
+			}
+		}
+		if (n == -1 && errno != EAGAIN && errno != EINTR)
+			die("watch: read failed: %s", strerror(errno));
+		timeout = changed->len ? WATCH_DEBOUNCE_MS : -1;
+	}
+
+	str_free(path);
+	table_destroy(&seen);
+	return ret == -1 ? -1 : 0;
+}
+
+void
+watch_destroy(struct Watch *w)
+{
+	close(w->fd);
+	for (size_t i = 0; i < w->dirs.len; i++)
+		free(w->dirs.data[i]);
+	array_destroy(&w->dirs);
+	table_destroy(&w->files);
+}
+
+#else
+
+int
+watch_init(struct Watch *w, struct Array *sources)
+{
+	(void)w;
+	(void)sources;
+	return -1;
+}
+
+int
+watch_wait(struct Watch *w, struct Array *changed)
+{
+	(void)w;
+	(void)changed;
+	return -1;
+}
+
+void
+watch_destroy(struct Watch *w)
+{
+	(void)w;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef INCLUDE_WATCH_H
+#define INCLUDE_WATCH_H
+
+#include "simpleds.h"
+#include "table.h"
+
+/* How long things have to stay quiet before a batch of changes is handed
+ * over, so that e.g. a save touching several files is one rebuild */
+#define WATCH_DEBOUNCE_MS 50
+
+/*
+ * Watches the directories holding a set of source files (editors like to
+ * replace files rather than write them, which only the directory sees) and
+ * reports which of the sources changed. Linux only, for now.
+ */
+struct Watch {
+	int fd;
+	struct Array dirs;  /* watch descriptor -> directory prefix, or NULL */
+	struct Table files; /* path -> struct Target * */
+};
+
+int
+watch_init(struct Watch *w, struct Array *sources);
+int
+watch_wait(struct Watch *w, struct Array *changed);
+void
+watch_destroy(struct Watch *w);
+
+#endif